@@ -0,0 +1,163 @@
+//////////////////////////////////////////////////////////////////////////////////////
+// Check and timing of the tokenizer of whisper.cpp against the std::regex tokenizer it replaced
+//  - whisper_tokenize splits the text with a hand-written pre-tokenizer and matches the longest
+//    tokens of each word with a byte trie of the vocabulary
+//  - regex_tokenize below is the previous implementation: a std::regex split of the text and a lookup
+//    of each substring of a word in the vocabulary
+//  - both should give the same tokens on random strings (contractions, whitespace runs, digits, UTF-8
+//    and random bytes), the time is measured on 10800 characters of text
+//
+// Build the library and compile against it, the g++ command is a single line (from inst/whisper.cpp):
+//   cmake -S . -B build -DBUILD_SHARED_LIBS=OFF && cmake --build build -j
+//   g++ -O2 -std=c++17 -Iinclude -Iggml/include ../benchmark/tokenizer-regex.cpp -o tokenizer-regex
+//       build/src/libwhisper.a build/ggml/src/libggml.a build/ggml/src/libggml-cpu.a build/ggml/src/libggml-base.a -lpthread -fopenmp
+//   ./tokenizer-regex ggml-tiny.bin
+//
+//////////////////////////////////////////////////////////////////////////////////////
+#include "whisper.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+static void log_quiet(enum ggml_log_level level, const char * text, void * user_data) {
+    (void) level; (void) text; (void) user_data;
+}
+
+// the tokenizer of whisper.cpp before the pre-tokenizer and the trie
+static std::vector<whisper_token> regex_tokenize(const std::map<std::string, whisper_token> & token_to_id, const std::string & text) {
+    std::vector<std::string> words;
+
+    // first split the text into words
+    {
+        std::string str = text;
+        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+
+        std::regex re(pat);
+        std::smatch m;
+
+        while (std::regex_search(str, m, re)) {
+            for (auto x : m) {
+                words.push_back(x);
+            }
+            str = m.suffix();
+        }
+    }
+
+    // find the longest tokens that form the words
+    std::vector<whisper_token> tokens;
+    for (const auto & word : words) {
+        if (word.empty()) continue;
+
+        int i = 0;
+        int n = word.size();
+        while (i < n) {
+            int j = n;
+            bool found = false;
+            while (j > i) {
+                auto sub = word.substr(i, j-i);
+                auto it = token_to_id.find(sub);
+                if (it != token_to_id.end()) {
+                    tokens.push_back(it->second);
+                    i = j;
+                    found = true;
+                    break;
+                }
+                --j;
+            }
+            if (!found) {
+                ++i;
+            }
+        }
+    }
+
+    return tokens;
+}
+
+static std::vector<whisper_token> trie_tokenize(whisper_context * ctx, const std::string & text) {
+    std::vector<whisper_token> tokens(text.size() + 1);
+    const int n = whisper_tokenize(ctx, text.c_str(), tokens.data(), tokens.size());
+    tokens.resize(n < 0 ? 0 : n);
+    return tokens;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s model.bin [n_strings]\n", argv[0]);
+        return 1;
+    }
+    const int n_strings = argc > 2 ? atoi(argv[2]) : 20000;
+
+    whisper_log_set(log_quiet, nullptr);
+
+    whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu = false;
+    whisper_context * ctx = whisper_init_from_file_with_params(argv[1], cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "failed to load the model %s\n", argv[1]);
+        return 1;
+    }
+
+    std::map<std::string, whisper_token> token_to_id;
+    for (whisper_token id = 0; id < whisper_n_vocab(ctx); ++id) {
+        token_to_id[whisper_token_to_str(ctx, id)] = id;
+    }
+
+    // random strings made of pieces which exercise the pre-tokenizer, the texts are passed as C strings so without NUL bytes
+    const std::vector<std::string> pieces = {
+        "a", "Z", "hello", " world", "'s", "'re", "'ll", "'d", "'x", "'", " 'll", "don't", "I'm", "Ich bin's",
+        " ", "  ", "   ", "\t", "\n", "\r\n", "  \n ", " \t x", "x  ", "\v", "\f",
+        "123", " 42", "!?", ",", ". ", "--", "@#$%", "[_BEG_]", "<|endoftext|>",
+        "\xc3\xa9", "\xc3\x84\xc3\x96", "\xe6\x97\xa5\xe6\x9c\xac",
+    };
+    std::mt19937 rng(42);
+    int n_mismatch = 0;
+    for (int i = 0; i < n_strings; ++i) {
+        std::string text;
+        const int n_pieces = rng() % 12;
+        for (int j = 0; j < n_pieces; ++j) {
+            text += pieces[rng() % pieces.size()];
+        }
+        if (rng() % 4 == 0) {
+            for (int j = 0; j < 6; ++j) {
+                text += (char) (1 + rng() % 255);
+            }
+        }
+        if (regex_tokenize(token_to_id, text) != trie_tokenize(ctx, text)) {
+            if (n_mismatch++ < 5) {
+                printf("mismatch for the bytes:");
+                for (unsigned char c : text) {
+                    printf(" %02x", c);
+                }
+                printf("\n");
+            }
+        }
+    }
+    printf("%d random strings: %d mismatches\n", n_strings, n_mismatch);
+
+    std::string text;
+    for (int i = 0; i < 100; ++i) {
+        text += "And so my fellow Americans, ask not what your country can do for you, ask what you can do for your country. ";
+    }
+    for (int run = 1; run <= 3; ++run) {
+        const auto t0 = std::chrono::steady_clock::now();
+        const auto tokens_regex = regex_tokenize(token_to_id, text);
+        const auto t1 = std::chrono::steady_clock::now();
+        const auto tokens_trie = trie_tokenize(ctx, text);
+        const auto t2 = std::chrono::steady_clock::now();
+
+        printf("run %d, %zu characters, %zu tokens: regex %.3f ms, trie %.3f ms, same tokens: %s\n", run, text.size(), tokens_trie.size(),
+            std::chrono::duration<double, std::milli>(t1 - t0).count(),
+            std::chrono::duration<double, std::milli>(t2 - t1).count(),
+            tokens_regex == tokens_trie ? "yes" : "no");
+    }
+
+    whisper_free(ctx);
+
+    return n_mismatch == 0 ? 0 : 1;
+}
@@ -18,6 +18,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cfloat>
+#include <cinttypes>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <climits>
@@ -26,18 +27,42 @@
 #include <cstring>
 #include <fstream>
 #include <functional>
+#include <list>
 #include <map>
+#include <memory>
 #include <random>
 #include <regex>
 #include <set>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 
 #ifdef _MSC_VER
 #include <codecvt>
 #endif
 
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+// the model file reader which loads the tensor data with multiple threads relies on pread
+#if !defined(_WIN32) && !defined(WHISPER_BIG_ENDIAN)
+#define WHISPER_PARALLEL_LOAD
+#endif
+
 #if defined(WHISPER_BIG_ENDIAN)
 template<typename T>
 static T byteswap(T value) {
@@ -146,6 +171,10 @@ static constexpr float WHISPER_HISTORY_CONDITIONING_TEMP_CUTOFF = 0.5f;
 
 #define WHISPER_MAX_NODES 4096
 
+// the decoder attends to a multiple of this number of KV cache cells (the padding cells are masked),
+// such that the graph of the previous token can be reused for the next tokens, see whisper_decode_graph
+#define WHISPER_KV_GRAPH_PAD 32
+
 static std::string format(const char * fmt, ...) {
     va_list ap;
     va_list ap2;
@@ -417,8 +446,81 @@ struct whisper_mel {
     int n_mel;
 
     std::vector<float> data;
+
+    uint64_t hash = 0; // hash of the data, 0 if empty
+};
+
+// FNV-1a over the mel spectrogram, used to detect that the encoder input did not change
+static uint64_t whisper_mel_hash(const whisper_mel & mel) {
+    if (mel.data.empty()) {
+        return 0;
+    }
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    const auto mix = [&hash](uint32_t x) {
+        hash ^= x;
+        hash *= 0x100000001b3ULL;
+    };
+
+    mix(mel.n_len);
+    mix(mel.n_mel);
+
+    for (const float & f : mel.data) {
+        uint32_t x;
+        memcpy(&x, &f, sizeof(x));
+        mix(x);
+    }
+
+    return hash == 0 ? 1 : hash;
+}
+
+// identifies the encoder input of a window
+struct whisper_encoder_key {
+    uint64_t mel_hash   = 0; // 0 - invalid
+    int      mel_offset = 0;
+    int      n_ctx      = 0;
+
+    bool operator==(const whisper_encoder_key & other) const {
+        return mel_hash == other.mel_hash && mel_offset == other.mel_offset && n_ctx == other.n_ctx;
+    }
 };
 
+// [EXPERIMENTAL] encoder outputs of previously encoded windows, least recently used last
+struct whisper_encoder_cache {
+    size_t size     = 0; // current size in bytes
+    size_t size_max = 0; // 0 - disabled
+
+    std::list<std::pair<whisper_encoder_key, std::vector<float>>> entries;
+};
+
+static const std::vector<float> * whisper_encoder_cache_get(whisper_encoder_cache & cache, const whisper_encoder_key & key) {
+    for (auto it = cache.entries.begin(); it != cache.entries.end(); ++it) {
+        if (it->first == key) {
+            cache.entries.splice(cache.entries.begin(), cache.entries, it);
+            return &cache.entries.front().second;
+        }
+    }
+
+    return nullptr;
+}
+
+static void whisper_encoder_cache_put(whisper_encoder_cache & cache, const whisper_encoder_key & key, std::vector<float> && data) {
+    const size_t nbytes = data.size()*sizeof(float);
+
+    if (nbytes > cache.size_max) {
+        return;
+    }
+
+    while (!cache.entries.empty() && cache.size + nbytes > cache.size_max) {
+        cache.size -= cache.entries.back().second.size()*sizeof(float);
+        cache.entries.pop_back();
+    }
+
+    cache.entries.emplace_front(key, std::move(data));
+    cache.size += nbytes;
+}
+
 struct whisper_filters {
     int32_t n_mel;
     int32_t n_fft;
@@ -435,6 +537,18 @@ struct whisper_vocab {
     std::map<token, id> token_to_id;
     std::map<id, token> id_to_token;
 
+    // byte trie of token_to_id used by tokenize() to find the longest token, see whisper_vocab_init_trie
+    // the children of a node are the edges [edge_begin, edge_end), sorted by byte
+    struct trie_node {
+        id       token; // the token ending at this node, -1 if none
+        uint32_t edge_begin;
+        uint32_t edge_end;
+    };
+
+    std::vector<trie_node> trie;
+    std::vector<uint8_t>   trie_edge_byte;
+    std::vector<uint32_t>  trie_edge_node;
+
     // reference: https://github.com/openai/whisper/blob/248b6cb124225dd263bb9bd32d060b6517e067f8/whisper/tokenizer.py#L334-L349
     id token_eot        = 50256;
     id token_sot        = 50257;
@@ -541,6 +655,18 @@ struct whisper_sched {
     std::vector<uint8_t> meta;
 };
 
+// the last decoder graph built in the meta buffer of sched_decode and allocated by its scheduler
+// the next batch with the same shape reuses it and only sets the inputs, see whisper_decode_internal
+struct whisper_decode_graph {
+    struct ggml_cgraph * gf = nullptr; // nullptr: nothing to reuse
+
+    int32_t n_tokens;
+    int32_t n_kv;        // a multiple of WHISPER_KV_GRAPH_PAD
+    int32_t n_audio_ctx;
+    int32_t n_logits;    // n_vocab or the size of the active vocabulary
+    bool    save_alignment_heads_QKs;
+};
+
 static size_t whisper_sched_size(struct whisper_sched & allocr) {
     size_t size = allocr.meta.size();
     for (int i = 0; i < ggml_backend_sched_get_n_backends(allocr.sched); ++i) {
@@ -716,6 +842,223 @@ struct whisper_kv_cache {
     std::vector<uint8_t> ctx_buf;
 };
 
+// read-only memory mapping of a model file
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+
+#ifdef _WIN32
+    HANDLE hmap = NULL;
+#endif
+
+    whisper_mmap(const whisper_mmap &) = delete;
+    whisper_mmap & operator=(const whisper_mmap &) = delete;
+
+    explicit whisper_mmap(const char * path) {
+#ifdef _WIN32
+        const int n_wide = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+        std::wstring path_wide(n_wide, 0);
+        MultiByteToWideChar(CP_UTF8, 0, path, -1, &path_wide[0], n_wide);
+
+        HANDLE hfile = CreateFileW(path_wide.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hfile == INVALID_HANDLE_VALUE) {
+            return;
+        }
+
+        LARGE_INTEGER file_size;
+        if (GetFileSizeEx(hfile, &file_size) && file_size.QuadPart > 0) {
+            hmap = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (hmap != NULL) {
+                addr = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+                size = addr ? (size_t) file_size.QuadPart : 0;
+            }
+        }
+        CloseHandle(hfile);
+#else
+        const int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void * res = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (res != MAP_FAILED) {
+                addr = res;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~whisper_mmap() {
+#ifdef _WIN32
+        if (addr) {
+            UnmapViewOfFile(addr);
+        }
+        if (hmap != NULL) {
+            CloseHandle(hmap);
+        }
+#else
+        if (addr) {
+            munmap(addr, size);
+        }
+#endif
+    }
+
+    bool valid() const {
+        return addr != nullptr;
+    }
+};
+
+// whisper_model_loader context for reading from a whisper_mmap
+struct whisper_mmap_reader {
+    const whisper_mmap * mapping;
+
+    size_t pos = 0;
+    bool   eof = false;
+};
+
+// whisper_model_loader context for reading from a model file
+// the header, the vocabulary and the tensor headers are read sequentially through a buffer
+// the tensor data is skipped and read afterwards at its offset in the file with multiple threads
+struct whisper_file_reader {
+    int    fd   = -1;
+    size_t size = 0;
+
+    size_t pos = 0;
+    bool   eof = false;
+
+    std::vector<char> buf;
+    size_t buf_offs = 0;
+    size_t buf_size = 0;
+
+#ifdef WHISPER_PARALLEL_LOAD
+    whisper_file_reader(const whisper_file_reader &) = delete;
+    whisper_file_reader & operator=(const whisper_file_reader &) = delete;
+
+    explicit whisper_file_reader(const char * path) {
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            fd = -1;
+            return;
+        }
+        size = st.st_size;
+
+        buf.resize(1024*1024);
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+        // start the readahead of the whole file in the page cache
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    }
+
+    ~whisper_file_reader() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    bool valid() const {
+        return fd != -1;
+    }
+
+    // read exactly n bytes at offset offs - can be called from multiple threads
+    bool read_at(void * dst, size_t n, size_t offs) const {
+        char * out = (char *) dst;
+        while (n > 0) {
+            const ssize_t n_read = pread(fd, out, n, offs);
+            if (n_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n_read <= 0) {
+                return false;
+            }
+            out  += n_read;
+            n    -= n_read;
+            offs += n_read;
+        }
+        return true;
+    }
+
+    size_t read(void * dst, size_t n) {
+        char * out = (char *) dst;
+
+        size_t n_done = 0;
+        while (n_done < n) {
+            if (pos >= buf_offs && pos < buf_offs + buf_size) {
+                const size_t n_cur = std::min(n - n_done, buf_offs + buf_size - pos);
+                memcpy(out + n_done, buf.data() + (pos - buf_offs), n_cur);
+                n_done += n_cur;
+                pos    += n_cur;
+                continue;
+            }
+
+            if (pos >= size) {
+                break;
+            }
+
+            if (n - n_done >= buf.size()) {
+                // large reads bypass the buffer
+                if (pos + (n - n_done) > size || !read_at(out + n_done, n - n_done, pos)) {
+                    break;
+                }
+                pos   += n - n_done;
+                n_done = n;
+                break;
+            }
+
+            buf_offs = pos;
+            buf_size = std::min(buf.size(), size - pos);
+            if (!read_at(buf.data(), buf_size, buf_offs)) {
+                buf_size = 0;
+                break;
+            }
+        }
+
+        if (n_done < n) {
+            // same as std::ifstream: eof is set after an attempt to read past the end
+            memset(out + n_done, 0, n - n_done);
+            eof = true;
+        }
+
+        return n_done;
+    }
+#endif
+};
+
+// a part of the tensor data to copy from the model file to memory
+// tensors in a CPU extra buffer (e.g. repacked weights) are set as a whole with ggml_backend_tensor_set
+struct whisper_load_chunk {
+    void * dst;
+    size_t offs;
+    size_t size;
+
+    ggml_tensor * tensor = nullptr;
+};
+
+// parameters and weights of an encoder convolution computed by the fused convolution on the CPU, see whisper_conv_init
+struct whisper_conv_params {
+    int  stride;
+    bool split_out; // store the result with the even time steps first and the odd time steps second
+};
+
+struct whisper_conv_weights {
+    whisper_conv_params params = {};
+
+    // the weights in F32, in tiles of [n_ic][3][WHISPER_CONV_OB] for each WHISPER_CONV_OB output channels
+    // empty if the convolution is not fused
+    std::vector<float> wt;
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -733,6 +1076,10 @@ struct whisper_model {
     struct ggml_tensor * e_conv_2_w;
     struct ggml_tensor * e_conv_2_b;
 
+    // encoder.conv1 / encoder.conv2 for the fused convolution
+    whisper_conv_weights e_conv_1_fused;
+    whisper_conv_weights e_conv_2_fused;
+
     // encoder.ln_post
     struct ggml_tensor * e_ln_w;
     struct ggml_tensor * e_ln_b;
@@ -756,6 +1103,12 @@ struct whisper_model {
     // the model backend data is read-only and can be shared between processors
     std::vector<ggml_backend_buffer_t> buffers;
 
+    // memory mapping of the model file, if the weights are used from it directly (zero-copy)
+    std::unique_ptr<whisper_mmap> mapping;
+
+    // model file reader, only set while loading the model with whisper_init_from_file
+    whisper_file_reader * file_reader = nullptr;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
@@ -813,8 +1166,9 @@ struct whisper_decoder {
     std::vector<float> logits;
     std::vector<float> logprobs;
 
-    // work container used to avoid memory allocations
+    // work containers used to avoid memory allocations (the top-k heap of the beam search, the language probs)
     std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
+    std::vector<whisper_token_data>                      tokens_topk; // the tokens sampled by the beam search
 
     mutable std::mt19937 rng; // used for sampling at t > 0.0
 };
@@ -831,6 +1185,30 @@ struct vad_time_mapping {
     int64_t original_time;   // Corresponding time in original audio
 };
 
+// tokens suppressed by suppress_regex / suppress_nst, looked up in the vocabulary once instead of for every sampled token
+struct whisper_suppress {
+    std::string                regex;     // the suppress_regex of regex_ids
+    std::vector<whisper_token> regex_ids; // tokens matching regex
+    std::vector<whisper_token> nst_ids;   // non-speech tokens
+    bool                       nst_init = false;
+};
+
+// per-op profile of the graphs computed by a state, see whisper_set_profile
+struct whisper_profile {
+    // user data of the eval callback of the scheduler of each graph
+    struct graph_cb {
+        whisper_profile * profile;
+        const char      * graph;
+    };
+
+    graph_cb cbs[4];
+
+    int64_t t_start_us = 0;
+
+    std::vector<whisper_profile_op> ops;
+    std::map<std::string, size_t>   index;
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -841,12 +1219,16 @@ struct whisper_state {
 
     int32_t n_sample = 0; // number of tokens sampled
     int32_t n_encode = 0; // number of encoder calls
+    int32_t n_encode_cached = 0; // number of encoder calls which reused a previous encoder output
     int32_t n_decode = 0; // number of decoder calls with n_tokens == 1  (text-generation)
     int32_t n_batchd = 0; // number of decoder calls with n_tokens <  16 (batch decoding)
     int32_t n_prompt = 0; // number of decoder calls with n_tokens >  1  (prompt encoding)
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
 
+    int32_t n_drafted  = 0; // number of draft tokens proposed by speculative decoding
+    int32_t n_accepted = 0; // number of draft tokens accepted by the main model
+
     // number of decoders for which we have constructed the KV cache
     int32_t kv_self_n_dec = 0;
 
@@ -860,6 +1242,13 @@ struct whisper_state {
     // padded buffer for flash-attention
     whisper_kv_cache kv_pad;
 
+    // encoder input from which kv_cross was computed
+    // if the same window is encoded again, the cross-attention KV cache is reused as is
+    whisper_encoder_key kv_cross_key;
+
+    // cached encoder outputs - on a hit only the cross-attention KV cache is recomputed
+    whisper_encoder_cache enc_cache;
+
     whisper_mel mel;
 
     whisper_batch batch;
@@ -874,6 +1263,12 @@ struct whisper_state {
     whisper_sched sched_cross;
     whisper_sched sched_decode;
 
+    whisper_decode_graph gf_decode;
+
+    whisper_profile profile;
+
+    whisper_suppress suppress;
+
     // result of the encoder
     struct ggml_tensor * embd_conv = nullptr;
     struct ggml_tensor * embd_enc  = nullptr;
@@ -881,10 +1276,17 @@ struct whisper_state {
     // helpers for GPU offloading
     std::vector<float> inp_mel;
     std::vector<float> inp_mask;
+    std::vector<int32_t> inp_kv_idxs;
 
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
 
+    // [EXPERIMENTAL] active vocabulary (sorted token ids), see whisper_vocab_active_init
+    // while vocab_prune is set, the decoder only computes the logits of these tokens, the other logits are -INFINITY
+    std::vector<whisper_token> vocab_active;
+    std::vector<float>         logits_active; // one row of the logits of the active tokens
+    bool                       vocab_prune = false;
+
     std::vector<whisper_segment> result_all;
 
     // prompt history split into static prefix (prompt_past0) and dynamic rolling context (prompt_past1)
@@ -1012,6 +1414,10 @@ static bool whisper_kv_cache_init(
     return true;
 }
 
+static size_t whisper_kv_cache_nbytes(const struct whisper_kv_cache & cache) {
+    return ggml_nbytes(cache.k) + ggml_nbytes(cache.v);
+}
+
 static void whisper_kv_cache_free(struct whisper_kv_cache & cache) {
     ggml_backend_buffer_free(cache.buffer);
 }
@@ -1067,6 +1473,148 @@ static bool whisper_kv_cache_find_slot(
     return true;
 }
 
+// reassign sequences in a single pass over the cells: after the call, sequence j holds the cells
+// that sequence src[j] held before the call (src[j] < 0 leaves sequence j untouched)
+// the KV data is never copied - cells are shared between sequences by their seq_id sets
+static void whisper_kv_cache_seq_remap(
+           struct whisper_kv_cache & cache,
+                const whisper_seq_id * src,
+                                 int   n_seq) {
+    GGML_ASSERT(n_seq <= WHISPER_MAX_DECODERS);
+
+    bool had[WHISPER_MAX_DECODERS];
+
+    uint32_t new_head = cache.size;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        auto & cell = cache.cells[i];
+
+        if (cell.pos < 0) {
+            continue;
+        }
+
+        for (int j = 0; j < n_seq; ++j) {
+            had[j] = cell.has_seq_id(j);
+        }
+
+        for (int j = 0; j < n_seq; ++j) {
+            if (src[j] < 0) {
+                continue;
+            }
+
+            const bool want = src[j] < n_seq ? had[src[j]] : cell.has_seq_id(src[j]);
+
+            if (want && !had[j]) {
+                cell.seq_id.insert(j);
+            } else if (!want && had[j]) {
+                cell.seq_id.erase(j);
+            }
+        }
+
+        if (cell.seq_id.empty()) {
+            cell.pos = -1;
+            if (new_head == cache.size) new_head = i;
+        }
+    }
+
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head != cache.size) cache.head = new_head;
+}
+
+// move all used cells to the front of the cache, preserving their order
+// v_trans: the V cache is stored transposed (i.e. without flash attention)
+static void whisper_kv_cache_defrag(
+           struct whisper_kv_cache & cache,
+                             int64_t   n_text_layer,
+                                bool   v_trans) {
+    const int32_t n_ctx = cache.size;
+
+    // ids[i] = new index of cell i, -1 if the cell is unused
+    std::vector<int32_t> ids(n_ctx, -1);
+
+    int32_t n_used  = 0;
+    int32_t n_moved = 0;
+
+    for (int32_t i = 0; i < n_ctx; ++i) {
+        if (cache.cells[i].pos < 0 || cache.cells[i].seq_id.empty()) {
+            continue;
+        }
+        if (i != n_used) {
+            n_moved++;
+        }
+        ids[i] = n_used++;
+    }
+
+    if (n_moved == 0) {
+        cache.head = n_used;
+        return;
+    }
+
+    WHISPER_LOG_DEBUG("%s: moving %d of %d used cells\n", __func__, n_moved, n_used);
+
+    const int64_t n_state = ggml_nelements(cache.k)/(n_text_layer*n_ctx);
+
+    const size_t k_row = ggml_row_size(cache.k->type, n_state);
+    const size_t v_row = ggml_row_size(cache.v->type, n_state);
+    const size_t v_el  = ggml_element_size(cache.v);
+
+    // process one layer at a time to keep the host copy small
+    std::vector<uint8_t> buf(std::max(k_row, v_row)*n_ctx);
+
+    for (int64_t il = 0; il < n_text_layer; ++il) {
+        {
+            const size_t offs = il*n_ctx*k_row;
+
+            ggml_backend_tensor_get(cache.k, buf.data(), offs, n_ctx*k_row);
+            for (int32_t i = 0; i < n_ctx; ++i) {
+                if (ids[i] >= 0 && ids[i] != i) {
+                    memcpy(buf.data() + ids[i]*k_row, buf.data() + i*k_row, k_row);
+                }
+            }
+            ggml_backend_tensor_set(cache.k, buf.data(), offs, n_used*k_row);
+        }
+
+        if (!v_trans) {
+            const size_t offs = il*n_ctx*v_row;
+
+            ggml_backend_tensor_get(cache.v, buf.data(), offs, n_ctx*v_row);
+            for (int32_t i = 0; i < n_ctx; ++i) {
+                if (ids[i] >= 0 && ids[i] != i) {
+                    memcpy(buf.data() + ids[i]*v_row, buf.data() + i*v_row, v_row);
+                }
+            }
+            ggml_backend_tensor_set(cache.v, buf.data(), offs, n_used*v_row);
+        } else {
+            // [n_state][n_ctx] per layer
+            const size_t offs = il*n_ctx*n_state*v_el;
+
+            ggml_backend_tensor_get(cache.v, buf.data(), offs, n_ctx*n_state*v_el);
+            for (int64_t d = 0; d < n_state; ++d) {
+                uint8_t * row = buf.data() + d*n_ctx*v_el;
+                for (int32_t i = 0; i < n_ctx; ++i) {
+                    if (ids[i] >= 0 && ids[i] != i) {
+                        memcpy(row + ids[i]*v_el, row + i*v_el, v_el);
+                    }
+                }
+            }
+            ggml_backend_tensor_set(cache.v, buf.data(), offs, n_ctx*n_state*v_el);
+        }
+    }
+
+    // ids[i] <= i, so the cells can be moved in place
+    for (int32_t i = 0; i < n_ctx; ++i) {
+        if (ids[i] >= 0 && ids[i] != i) {
+            cache.cells[ids[i]] = std::move(cache.cells[i]);
+        }
+    }
+    for (int32_t i = n_used; i < n_ctx; ++i) {
+        cache.cells[i].pos = -1;
+        cache.cells[i].seq_id.clear();
+    }
+
+    cache.head = n_used;
+}
+
 // find how many cells are currently in use
 static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
     for (uint32_t i = cache.size - 1; i > 0; --i) {
@@ -1136,6 +1684,26 @@ static void whisper_kv_cache_seq_cp(
     }
 }
 
+static void whisper_kv_cache_seq_keep(
+        struct whisper_kv_cache & cache,
+                 whisper_seq_id   seq_id) {
+    uint32_t new_head = cache.size;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (!cache.cells[i].has_seq_id(seq_id)) {
+            cache.cells[i].pos = -1;
+            cache.cells[i].seq_id.clear();
+            if (new_head == cache.size) new_head = i;
+        } else {
+            cache.cells[i].seq_id.clear();
+            cache.cells[i].seq_id.insert(seq_id);
+        }
+    }
+
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head != cache.size) cache.head = new_head;
+}
+
 static uint32_t whisper_kv_cache_get_padding(const struct whisper_context & wctx) {
     if (!wctx.params.flash_attn || !wctx.params.use_gpu) {
         return 1u;
@@ -1385,7 +1953,7 @@ static buft_list_t make_buft_list(whisper_context_params & params) {
     auto * cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
     auto get_extra_bufts_fn = (ggml_backend_dev_get_extra_bufts_t)
         ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_dev_get_extra_bufts");
-    if (get_extra_bufts_fn) {
+    if (get_extra_bufts_fn && params.use_extra_bufts) {
         ggml_backend_buffer_type_t * extra_bufts = get_extra_bufts_fn(cpu_dev);
         while (extra_bufts && *extra_bufts) {
             buft_list.emplace_back(cpu_dev, *extra_bufts);
@@ -1467,32 +2035,271 @@ static ggml_backend_buffer_type_t select_weight_buft(const whisper_hparams & hpa
     return nullptr;
 }
 
-// load the model from a ggml file
-//
-// file format:
-//
-//   - hparams
-//   - pre-computed mel filters
-//   - vocab
-//   - weights
-//
-// see the convert-pt-to-ggml.py script for details
-//
-static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
-    WHISPER_LOG_INFO("%s: loading model\n", __func__);
+// metadata keys of GGUF model files
+// the hparams are listed in the order in which they are stored in the legacy ggml model files
+static const char * WHISPER_GGUF_KEYS_HPARAMS[] = {
+    "whisper.vocab_size",
+    "whisper.audio.context_length",
+    "whisper.audio.embedding_length",
+    "whisper.audio.head_count",
+    "whisper.audio.block_count",
+    "whisper.text.context_length",
+    "whisper.text.embedding_length",
+    "whisper.text.head_count",
+    "whisper.text.block_count",
+    "whisper.n_mels",
+    "general.file_type",
+};
 
-    const int64_t t_start_us = ggml_time_us();
+static const char * WHISPER_GGUF_KEY_ARCH          = "general.architecture";
+static const char * WHISPER_GGUF_KEY_FILTERS_N_MEL = "whisper.mel_filters.n_mel";
+static const char * WHISPER_GGUF_KEY_FILTERS_N_FFT = "whisper.mel_filters.n_fft";
+static const char * WHISPER_GGUF_KEY_FILTERS       = "whisper.mel_filters";
 
-    wctx.t_start_us = t_start_us;
+// the tokens are byte sequences which can contain 0 bytes, so they are not stored as an array of strings
+// but as their lengths and the concatenation of their bytes
+static const char * WHISPER_GGUF_KEY_TOKEN_LENGTHS = "whisper.vocab.token_lengths";
+static const char * WHISPER_GGUF_KEY_TOKEN_BYTES   = "whisper.vocab.token_bytes";
 
-    auto & model = wctx.model;
-    auto & vocab = wctx.vocab;
+static bool whisper_gguf_get_i32(const gguf_context * gguf, const char * key, int32_t & dst) {
+    const int64_t id = gguf_find_key(gguf, key);
+    if (id < 0) {
+        WHISPER_LOG_ERROR("%s: key '%s' not found in model file\n", __func__, key);
+        return false;
+    }
 
-    // verify magic
+    switch (gguf_get_kv_type(gguf, id)) {
+        case GGUF_TYPE_INT32:  dst = gguf_get_val_i32(gguf, id); break;
+        case GGUF_TYPE_UINT32: dst = (int32_t) gguf_get_val_u32(gguf, id); break;
+        default:
+            WHISPER_LOG_ERROR("%s: key '%s' has type %s, expected an integer\n", __func__, key, gguf_type_name(gguf_get_kv_type(gguf, id)));
+            return false;
+    }
+
+    return true;
+}
+
+static bool whisper_gguf_get_arr(const gguf_context * gguf, const char * key, gguf_type type, const void * & data, size_t & n) {
+    const int64_t id = gguf_find_key(gguf, key);
+    if (id < 0 || gguf_get_kv_type(gguf, id) != GGUF_TYPE_ARRAY || gguf_get_arr_type(gguf, id) != type) {
+        WHISPER_LOG_ERROR("%s: key '%s' not found in model file or not an array of %s\n", __func__, key, gguf_type_name(type));
+        return false;
+    }
+
+    data = gguf_get_arr_data(gguf, id);
+    n    = gguf_get_arr_n(gguf, id);
+
+    return true;
+}
+
+// tensor in a buffer of the CPU device which is not in host memory, e.g. weights repacked for the CPU extra buffer types
+static bool whisper_tensor_is_cpu_extra(const ggml_tensor * tensor) {
+    if (ggml_backend_buffer_is_host(tensor->buffer)) {
+        return false;
+    }
+
+    ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(tensor->buffer));
+
+    return dev && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU;
+}
+
+// copy the tensor data from the memory mapped model file, or read it from the model file, with n_threads
+// large tensors are split in parts of at most 8 MB to balance the work over the threads
+static bool whisper_model_load_chunks(const whisper_model & model, const std::vector<whisper_load_chunk> & chunks, int n_threads) {
+    const size_t size_max = 8*1024*1024;
+
+    std::vector<whisper_load_chunk> parts;
+    for (const auto & chunk : chunks) {
+        if (chunk.tensor) {
+            parts.push_back(chunk);
+            continue;
+        }
+        for (size_t offs = 0; offs < chunk.size; offs += size_max) {
+            parts.push_back({ (char *) chunk.dst + offs, chunk.offs + offs, std::min(size_max, chunk.size - offs) });
+        }
+    }
+
+    std::atomic<size_t> i_next(0);
+    std::atomic<bool>   ok(true);
+
+    auto worker = [&]() {
+        std::vector<char> buf;
+
+        while (ok) {
+            const size_t i = i_next++;
+            if (i >= parts.size()) {
+                break;
+            }
+
+            const auto & part = parts[i];
+
+            if (part.tensor) {
+                // the buffer converts the data when setting the tensor, e.g. repacking the weights
+                if (model.mapping) {
+                    ggml_backend_tensor_set(part.tensor, (const char *) model.mapping->addr + part.offs, 0, part.size);
+                } else {
+#ifdef WHISPER_PARALLEL_LOAD
+                    buf.resize(part.size);
+                    if (model.file_reader->read_at(buf.data(), part.size, part.offs)) {
+                        ggml_backend_tensor_set(part.tensor, buf.data(), 0, part.size);
+                    } else {
+                        ok = false;
+                    }
+#else
+                    ok = false;
+#endif
+                }
+            } else if (model.mapping) {
+                memcpy(part.dst, (const char *) model.mapping->addr + part.offs, part.size);
+            } else {
+#ifdef WHISPER_PARALLEL_LOAD
+                if (!model.file_reader->read_at(part.dst, part.size, part.offs)) {
+                    ok = false;
+                }
+#else
+                ok = false;
+#endif
+            }
+        }
+    };
+
+    n_threads = std::max(1, std::min(n_threads, (int) parts.size()));
+
+    std::vector<std::thread> workers(n_threads - 1);
+    for (auto & w : workers) {
+        w = std::thread(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    return ok;
+}
+
+// the byte trie of the vocabulary for the tokens toks[lo, hi) which share their first depth bytes, returns the node
+static uint32_t whisper_vocab_build_trie(
+        whisper_vocab & vocab,
+        const std::vector<const std::pair<const whisper_vocab::token, whisper_vocab::id> *> & toks,
+        size_t lo, size_t hi, size_t depth) {
+    const uint32_t node = vocab.trie.size();
+    vocab.trie.push_back({ -1, 0, 0 });
+
+    // the tokens are sorted, such that the token ending here comes first
+    if (lo < hi && toks[lo]->first.size() == depth) {
+        vocab.trie[node].token = toks[lo]->second;
+        ++lo;
+    }
+
+    uint32_t n_edges = 0;
+    for (size_t k = lo; k < hi; ++k) {
+        if (k == lo || toks[k]->first[depth] != toks[k - 1]->first[depth]) {
+            ++n_edges;
+        }
+    }
+
+    const uint32_t e0 = vocab.trie_edge_byte.size();
+
+    vocab.trie[node].edge_begin = e0;
+    vocab.trie[node].edge_end   = e0 + n_edges;
+
+    vocab.trie_edge_byte.resize(e0 + n_edges);
+    vocab.trie_edge_node.resize(e0 + n_edges);
+
+    for (size_t k = lo, e = e0; k < hi; ++e) {
+        const char c = toks[k]->first[depth];
+
+        size_t k1 = k + 1;
+        while (k1 < hi && toks[k1]->first[depth] == c) {
+            ++k1;
+        }
+
+        const uint32_t child = whisper_vocab_build_trie(vocab, toks, k, k1, depth + 1);
+
+        vocab.trie_edge_byte[e] = (uint8_t) c;
+        vocab.trie_edge_node[e] = child;
+
+        k = k1;
+    }
+
+    return node;
+}
+
+static void whisper_vocab_init_trie(whisper_vocab & vocab) {
+    std::vector<const std::pair<const whisper_vocab::token, whisper_vocab::id> *> toks;
+    toks.reserve(vocab.token_to_id.size());
+    for (const auto & kv : vocab.token_to_id) {
+        toks.push_back(&kv);
+    }
+
+    vocab.trie.clear();
+    vocab.trie_edge_byte.clear();
+    vocab.trie_edge_node.clear();
+
+    whisper_vocab_build_trie(vocab, toks, 0, toks.size(), 0);
+}
+
+// load the model from a ggml file
+//
+// file format:
+//
+//   - hparams
+//   - pre-computed mel filters
+//   - vocab
+//   - weights
+//
+// see the convert-pt-to-ggml.py script for details
+//
+// GGUF files are also accepted: the hparams, the mel filters and the vocab are read from
+// the WHISPER_GGUF_KEY_* metadata and the weights from the tensors with the same names
+//
+static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
+    WHISPER_LOG_INFO("%s: loading model\n", __func__);
+
+    const int64_t t_start_us = ggml_time_us();
+
+    wctx.t_start_us = t_start_us;
+
+    auto & model = wctx.model;
+    auto & vocab = wctx.vocab;
+
+    // GGUF model file: the hparams, the mel filters and the vocabulary are read from its metadata
+    // and the tensor data is read at the offsets given in the metadata
+    gguf_context_ptr gguf;
+    ggml_context_ptr gguf_meta;
+
+    // verify magic
     {
         uint32_t magic;
         read_safe(loader, magic);
-        if (magic != GGML_FILE_MAGIC) {
+        if (memcmp(&magic, GGUF_MAGIC, sizeof(magic)) == 0) {
+            if (wctx.path_model.empty()) {
+                WHISPER_LOG_ERROR("%s: GGUF models can only be loaded with whisper_init_from_file*()\n", __func__);
+                return false;
+            }
+
+            ggml_context * meta = nullptr;
+
+            gguf_init_params gparams = {
+                /*.no_alloc =*/ true,
+                /*.ctx      =*/ &meta,
+            };
+
+            gguf.reset(gguf_init_from_file(wctx.path_model.c_str(), gparams));
+            if (!gguf) {
+                WHISPER_LOG_ERROR("%s: failed to read the metadata of the GGUF model file\n", __func__);
+                return false;
+            }
+            gguf_meta.reset(meta);
+
+            const int64_t id_arch = gguf_find_key(gguf.get(), WHISPER_GGUF_KEY_ARCH);
+            if (id_arch < 0 || gguf_get_kv_type(gguf.get(), id_arch) != GGUF_TYPE_STRING || strcmp(gguf_get_val_str(gguf.get(), id_arch), "whisper") != 0) {
+                WHISPER_LOG_ERROR("%s: GGUF model file is not a whisper model\n", __func__);
+                return false;
+            }
+
+            WHISPER_LOG_INFO("%s: GGUF model file version %d with %d tensors\n", __func__, (int) gguf_get_version(gguf.get()), (int) gguf_get_n_tensors(gguf.get()));
+        } else if (magic != GGML_FILE_MAGIC) {
             WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
             return false;
         }
@@ -1502,17 +2309,30 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     {
         auto & hparams = model.hparams;
 
-        read_safe(loader, hparams.n_vocab);
-        read_safe(loader, hparams.n_audio_ctx);
-        read_safe(loader, hparams.n_audio_state);
-        read_safe(loader, hparams.n_audio_head);
-        read_safe(loader, hparams.n_audio_layer);
-        read_safe(loader, hparams.n_text_ctx);
-        read_safe(loader, hparams.n_text_state);
-        read_safe(loader, hparams.n_text_head);
-        read_safe(loader, hparams.n_text_layer);
-        read_safe(loader, hparams.n_mels);
-        read_safe(loader, hparams.ftype);
+        int32_t * hparams_file[] = {
+            &hparams.n_vocab,
+            &hparams.n_audio_ctx,
+            &hparams.n_audio_state,
+            &hparams.n_audio_head,
+            &hparams.n_audio_layer,
+            &hparams.n_text_ctx,
+            &hparams.n_text_state,
+            &hparams.n_text_head,
+            &hparams.n_text_layer,
+            &hparams.n_mels,
+            &hparams.ftype,
+        };
+        static_assert(sizeof(hparams_file)/sizeof(hparams_file[0]) == sizeof(WHISPER_GGUF_KEYS_HPARAMS)/sizeof(WHISPER_GGUF_KEYS_HPARAMS[0]), "hparams and GGUF keys mismatch");
+
+        for (size_t i = 0; i < sizeof(hparams_file)/sizeof(hparams_file[0]); ++i) {
+            if (gguf) {
+                if (!whisper_gguf_get_i32(gguf.get(), WHISPER_GGUF_KEYS_HPARAMS[i], *hparams_file[i])) {
+                    return false;
+                }
+            } else {
+                read_safe(loader, *hparams_file[i]);
+            }
+        }
 
         assert(hparams.n_text_state == hparams.n_audio_state);
 
@@ -1573,48 +2393,97 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     {
         auto & filters = wctx.model.filters;
 
-        read_safe(loader, filters.n_mel);
-        read_safe(loader, filters.n_fft);
+        if (gguf) {
+            const void * data = nullptr;
+            size_t n = 0;
+
+            if (!whisper_gguf_get_i32(gguf.get(), WHISPER_GGUF_KEY_FILTERS_N_MEL, filters.n_mel) ||
+                !whisper_gguf_get_i32(gguf.get(), WHISPER_GGUF_KEY_FILTERS_N_FFT, filters.n_fft) ||
+                !whisper_gguf_get_arr(gguf.get(), WHISPER_GGUF_KEY_FILTERS, GGUF_TYPE_FLOAT32, data, n)) {
+                return false;
+            }
+
+            if (n != (size_t) filters.n_mel * filters.n_fft) {
+                WHISPER_LOG_ERROR("%s: invalid mel filters in model file (%zu values, expected %d x %d)\n", __func__, n, filters.n_mel, filters.n_fft);
+                return false;
+            }
+
+            filters.data.assign((const float *) data, (const float *) data + n);
+        } else {
+            read_safe(loader, filters.n_mel);
+            read_safe(loader, filters.n_fft);
 
-        filters.data.resize(filters.n_mel * filters.n_fft);
-        loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
-        BYTESWAP_FILTERS(filters);
+            filters.data.resize(filters.n_mel * filters.n_fft);
+            loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
+            BYTESWAP_FILTERS(filters);
+        }
     }
 
     // load vocab
     {
         int32_t n_vocab = 0;
-        read_safe(loader, n_vocab);
-
-        //if (n_vocab != model.hparams.n_vocab) {
-        //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
-        //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
-        //    return false;
-        //}
 
         std::string word;
-        std::vector<char> tmp;
 
-        tmp.reserve(128);
+        if (gguf) {
+            const void * lengths = nullptr;
+            const void * bytes   = nullptr;
+            size_t n_lengths = 0;
+            size_t n_bytes   = 0;
 
-        for (int i = 0; i < n_vocab; i++) {
-            uint32_t len;
-            read_safe(loader, len);
+            if (!whisper_gguf_get_arr(gguf.get(), WHISPER_GGUF_KEY_TOKEN_LENGTHS, GGUF_TYPE_UINT32, lengths, n_lengths) ||
+                !whisper_gguf_get_arr(gguf.get(), WHISPER_GGUF_KEY_TOKEN_BYTES,   GGUF_TYPE_UINT8,  bytes,   n_bytes)) {
+                return false;
+            }
 
-            if (len > 0) {
-                tmp.resize(len);
-                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-                word.assign(&tmp[0], tmp.size());
-            } else {
-                // seems like we have an empty-string token in multi-language models (i = 50256)
-                //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
-                word = "";
+            n_vocab = (int32_t) n_lengths;
+
+            size_t offs = 0;
+            for (int i = 0; i < n_vocab; i++) {
+                const uint32_t len = ((const uint32_t *) lengths)[i];
+                if (offs + len > n_bytes) {
+                    WHISPER_LOG_ERROR("%s: invalid vocabulary in model file\n", __func__);
+                    return false;
+                }
+
+                word.assign((const char *) bytes + offs, len);
+                offs += len;
+
+                vocab.token_to_id[word] = i;
+                vocab.id_to_token[i] = word;
             }
+        } else {
+            read_safe(loader, n_vocab);
+
+            //if (n_vocab != model.hparams.n_vocab) {
+            //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
+            //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
+            //    return false;
+            //}
+
+            std::vector<char> tmp;
+
+            tmp.reserve(128);
+
+            for (int i = 0; i < n_vocab; i++) {
+                uint32_t len;
+                read_safe(loader, len);
+
+                if (len > 0) {
+                    tmp.resize(len);
+                    loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+                    word.assign(&tmp[0], tmp.size());
+                } else {
+                    // seems like we have an empty-string token in multi-language models (i = 50256)
+                    //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
+                    word = "";
+                }
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+                vocab.token_to_id[word] = i;
+                vocab.id_to_token[i] = word;
 
-            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+                //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+            }
         }
 
         vocab.n_vocab = model.hparams.n_vocab;
@@ -1667,6 +2536,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             }
         }
 
+        whisper_vocab_init_trie(vocab);
+
         WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
     }
 
@@ -1708,6 +2579,16 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     buft_list_t buft_list = make_buft_list(wctx.params);
 
     auto create_tensor = [&](asr_tensor type, asr_system system, ggml_tensor * meta, int layer = 0) -> ggml_tensor * {
+        const std::string name = format(ASR_TENSOR_NAMES.at(system).at(type), layer);
+
+        if (gguf_meta) {
+            // the type of each tensor is given by the GGUF model file
+            ggml_tensor * meta_file = ggml_get_tensor(gguf_meta.get(), name.c_str());
+            if (meta_file && ggml_are_same_shape(meta_file, meta)) {
+                meta = meta_file;
+            }
+        }
+
         ggml_op op = ASR_TENSOR_INFO.at(type);
         ggml_backend_buffer_type_t buft = select_weight_buft(hparams, meta, op, buft_list);
         if (!buft) {
@@ -1717,7 +2598,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         ggml_context * ctx = get_ctx(buft);
         ggml_tensor * tensor = ggml_dup_tensor(ctx, meta);
 
-        model.tensors[format(ASR_TENSOR_NAMES.at(system).at(type), layer)] = tensor;
+        model.tensors[name] = tensor;
 
         return tensor;
     };
@@ -1841,10 +2722,36 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         ggml_free(ctx);
     }
 
+    // with a memory mapped model file, the tensors in CPU memory use the data of the mapping directly
+    // they are allocated while reading the tensor headers, see below
+    whisper_mmap_reader * mmap_reader = nullptr;
+    ggml_backend_buffer_t buf_mmap    = nullptr;
+
+    std::set<ggml_tensor *> mmap_tensors;
+
+#if !defined(WHISPER_BIG_ENDIAN)
+    if (model.mapping) {
+        mmap_reader = (whisper_mmap_reader *) loader->context;
+
+        auto it = ctx_map.find(ggml_backend_cpu_buffer_type());
+        if (it != ctx_map.end()) {
+            for (ggml_tensor * t = ggml_get_first_tensor(it->second); t != nullptr; t = ggml_get_next_tensor(it->second, t)) {
+                mmap_tensors.insert(t);
+            }
+
+            buf_mmap = ggml_backend_cpu_buffer_from_ptr(model.mapping->addr, model.mapping->size);
+            model.buffers.emplace_back(buf_mmap);
+        }
+    }
+#endif
+
     // allocate tensors in the backend buffers
     for (auto & p : ctx_map) {
         ggml_backend_buffer_type_t buft = p.first;
         ggml_context * ctx = p.second;
+        if (buf_mmap && buft == ggml_backend_cpu_buffer_type()) {
+            continue;
+        }
         ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
         if (buf) {
             model.buffers.emplace_back(buf);
@@ -1862,113 +2769,633 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         std::vector<char> read_buf;
 
-        while (true) {
-            int32_t n_dims;
-            int32_t length;
-            int32_t ttype;
+        // tensors in the mapped file which are not suitably aligned: copied after the loading
+        std::vector<std::pair<ggml_tensor *, size_t>> mmap_copies;
 
-            read_safe(loader, n_dims);
-            read_safe(loader, length);
-            read_safe(loader, ttype);
+        // tensor data which is read from the model file after all the tensor headers are read
+        std::vector<whisper_load_chunk> load_chunks;
 
-            if (loader->eof(loader->context)) {
-                break;
-            }
+        if (gguf) {
+            // the tensor data is read in the order in which it is stored in the file
+            std::vector<std::tuple<size_t, std::string, ggml_tensor *>> tensors_file;
 
-            int32_t nelements = 1;
-            int32_t ne[4] = { 1, 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                read_safe(loader, ne[i]);
-                nelements *= ne[i];
-            }
+            const size_t offs_data = gguf_get_data_offset(gguf.get());
 
-            std::string name;
-            std::vector<char> tmp(length); // create a buffer
-            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-            name.assign(&tmp[0], tmp.size());
+            for (const auto & it : model.tensors) {
+                const std::string & name = it.first;
+                ggml_tensor * tensor = it.second;
 
-            if (model.tensors.find(name) == model.tensors.end()) {
-                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
-                return false;
-            }
+                const int64_t id = gguf_find_tensor(gguf.get(), name.c_str());
+                if (id < 0) {
+                    if (gguf_get_n_tensors(gguf.get()) == 0) {
+                        break;
+                    }
+                    WHISPER_LOG_ERROR("%s: tensor '%s' not found in model file\n", __func__, name.c_str());
+                    return false;
+                }
 
-            auto tensor = model.tensors[name.data()];
+                const ggml_tensor * meta_file = ggml_get_tensor(gguf_meta.get(), name.c_str());
+                if (meta_file->type != tensor->type || !ggml_are_same_shape(meta_file, tensor)) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                            __func__, name.c_str(), (int) meta_file->ne[0], (int) meta_file->ne[1], (int) meta_file->ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                    return false;
+                }
 
-            if (ggml_nelements(tensor) != nelements) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
-                WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
-                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
-                return false;
+                tensors_file.emplace_back(offs_data + gguf_get_tensor_offset(gguf.get(), id), name, tensor);
             }
 
-            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
-                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
-                return false;
-            }
+            std::sort(tensors_file.begin(), tensors_file.end());
 
-            const size_t bpe = ggml_type_size(ggml_type(ttype));
+            // position of the loader in the file, after the magic
+            size_t pos = sizeof(uint32_t);
 
-            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
-                return false;
-            }
+            for (const auto & tf : tensors_file) {
+                const size_t        offs   = std::get<0>(tf);
+                const std::string & name   = std::get<1>(tf);
+                ggml_tensor *       tensor = std::get<2>(tf);
 
-            if (ggml_backend_buffer_is_host(tensor->buffer)) {
-                // for the CPU and Metal backend, we can read directly into the tensor
-                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-                BYTESWAP_TENSOR(tensor);
-            } else {
-                // read into a temporary buffer first, then copy to device memory
-                read_buf.resize(ggml_nbytes(tensor));
+                const size_t nbytes = ggml_nbytes(tensor);
 
-                loader->read(loader->context, read_buf.data(), read_buf.size());
+                if (mmap_tensors.count(tensor)) {
+                    if (offs + nbytes > model.mapping->size) {
+                        WHISPER_LOG_ERROR("%s: tensor '%s' data is out of the file bounds\n", __func__, name.c_str());
+                        return false;
+                    }
 
-                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
-            }
+                    // the tensor data in GGUF files is aligned, it can always be used in place
+                    ggml_backend_tensor_alloc(buf_mmap, tensor, (char *) model.mapping->addr + offs);
+                } else if ((model.mapping || model.file_reader) && whisper_tensor_is_cpu_extra(tensor)) {
+                    if (offs + nbytes > (model.mapping ? model.mapping->size : model.file_reader->size)) {
+                        WHISPER_LOG_ERROR("%s: tensor '%s' data is out of the file bounds\n", __func__, name.c_str());
+                        return false;
+                    }
 
-            total_size += ggml_nbytes(tensor);
-            model.n_loaded++;
-        }
+                    load_chunks.push_back({ nullptr, offs, nbytes, tensor });
+                } else if (model.file_reader && ggml_backend_buffer_is_host(tensor->buffer)) {
+                    if (offs + nbytes > model.file_reader->size) {
+                        WHISPER_LOG_ERROR("%s: tensor '%s' data is out of the file bounds\n", __func__, name.c_str());
+                        return false;
+                    }
 
-        WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
+                    load_chunks.push_back({ tensor->data, offs, nbytes });
+                } else {
+                    // skip up to the tensor data
+                    while (pos < offs) {
+                        read_buf.resize(std::min<size_t>(offs - pos, 1024*1024));
+                        loader->read(loader->context, read_buf.data(), read_buf.size());
+                        pos += read_buf.size();
+                    }
 
-        if (model.n_loaded == 0) {
-            WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
-        } else if (model.n_loaded != (int) model.tensors.size()) {
-            WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
-            return false;
-        }
-    }
+                    if (ggml_backend_buffer_is_host(tensor->buffer)) {
+                        loader->read(loader->context, tensor->data, nbytes);
+                        BYTESWAP_TENSOR(tensor);
+                    } else {
+                        read_buf.resize(nbytes);
 
-    for (auto & buf : model.buffers) {
-        ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
-    }
+                        loader->read(loader->context, read_buf.data(), read_buf.size());
 
-    wctx.t_load_us = ggml_time_us() - t_start_us;
+                        ggml_backend_tensor_set(tensor, read_buf.data(), 0, nbytes);
+                    }
+                    pos += nbytes;
 
-    return true;
-}
+                    if (loader->eof(loader->context)) {
+                        WHISPER_LOG_ERROR("%s: tensor '%s' data is out of the file bounds\n", __func__, name.c_str());
+                        return false;
+                    }
+                }
 
-static bool whisper_encode_external(const whisper_state & wstate) {
-    GGML_UNUSED(wstate);
+                total_size += nbytes;
+                model.n_loaded++;
+            }
+        } else {
+            while (true) {
+                int32_t n_dims;
+                int32_t length;
+                int32_t ttype;
 
-#ifndef WHISPER_USE_COREML
-    const bool use_coreml = false;
-#else
-    const bool use_coreml = wstate.ctx_coreml != nullptr;
-#endif
+                read_safe(loader, n_dims);
+                read_safe(loader, length);
+                read_safe(loader, ttype);
 
-#ifndef WHISPER_USE_OPENVINO
-    const bool use_openvino = false;
-#else
+                if (loader->eof(loader->context)) {
+                    break;
+                }
+
+                int32_t nelements = 1;
+                int32_t ne[4] = { 1, 1, 1, 1 };
+                for (int i = 0; i < n_dims; ++i) {
+                    read_safe(loader, ne[i]);
+                    nelements *= ne[i];
+                }
+
+                std::string name;
+                std::vector<char> tmp(length); // create a buffer
+                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+                name.assign(&tmp[0], tmp.size());
+
+                if (model.tensors.find(name) == model.tensors.end()) {
+                    WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
+                    return false;
+                }
+
+                auto tensor = model.tensors[name.data()];
+
+                if (ggml_nelements(tensor) != nelements) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
+                    WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
+                            __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                    return false;
+                }
+
+                if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                            __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+                    return false;
+                }
+
+                const size_t bpe = ggml_type_size(ggml_type(ttype));
+
+                if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                            __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                    return false;
+                }
+
+                if (mmap_tensors.count(tensor)) {
+                    // use the data in the mapped file if it is aligned to the element type of the tensor
+                    const size_t offs  = mmap_reader->pos;
+                    const size_t align = tensor->type == GGML_TYPE_F32 ? sizeof(float) : sizeof(ggml_fp16_t);
+
+                    if (offs + ggml_nbytes(tensor) > model.mapping->size) {
+                        WHISPER_LOG_ERROR("%s: tensor '%s' data is out of the file bounds\n", __func__, name.data());
+                        return false;
+                    }
+
+                    if (offs % align == 0) {
+                        ggml_backend_tensor_alloc(buf_mmap, tensor, (char *) model.mapping->addr + offs);
+                    } else {
+                        mmap_copies.emplace_back(tensor, offs);
+                    }
+
+                    mmap_reader->pos += ggml_nbytes(tensor);
+                } else if ((mmap_reader || model.file_reader) && whisper_tensor_is_cpu_extra(tensor)) {
+                    size_t & pos = mmap_reader ? mmap_reader->pos : model.file_reader->pos;
+
+                    if (pos + ggml_nbytes(tensor) > (model.mapping ? model.mapping->size : model.file_reader->size)) {
+                        WHISPER_LOG_ERROR("%s: tensor '%s' data is out of the file bounds\n", __func__, name.data());
+                        return false;
+                    }
+
+                    load_chunks.push_back({ nullptr, pos, ggml_nbytes(tensor), tensor });
+
+                    pos += ggml_nbytes(tensor);
+                } else if (model.file_reader && ggml_backend_buffer_is_host(tensor->buffer)) {
+                    if (model.file_reader->pos + ggml_nbytes(tensor) > model.file_reader->size) {
+                        WHISPER_LOG_ERROR("%s: tensor '%s' data is out of the file bounds\n", __func__, name.data());
+                        return false;
+                    }
+
+                    load_chunks.push_back({ tensor->data, model.file_reader->pos, ggml_nbytes(tensor) });
+
+                    model.file_reader->pos += ggml_nbytes(tensor);
+                } else if (ggml_backend_buffer_is_host(tensor->buffer)) {
+                    // for the CPU and Metal backend, we can read directly into the tensor
+                    loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                    BYTESWAP_TENSOR(tensor);
+                } else {
+                    // read into a temporary buffer first, then copy to device memory
+                    read_buf.resize(ggml_nbytes(tensor));
+
+                    loader->read(loader->context, read_buf.data(), read_buf.size());
+
+                    ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+                }
+
+                total_size += ggml_nbytes(tensor);
+                model.n_loaded++;
+            }
+        }
+
+        if (buf_mmap) {
+            size_t size_mapped = 0;
+            for (ggml_tensor * t : mmap_tensors) {
+                if (t->buffer == buf_mmap) {
+                    size_mapped += ggml_nbytes(t);
+                }
+            }
+            WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB (zero-copy)\n", __func__, ggml_backend_buffer_name(buf_mmap), size_mapped / 1e6);
+
+            // allocate the remaining CPU tensors (unaligned in the file or missing) and copy their data
+            ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx_map.at(ggml_backend_cpu_buffer_type()), ggml_backend_cpu_buffer_type());
+            if (buf) {
+                model.buffers.emplace_back(buf);
+
+                WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf) / 1e6);
+            }
+
+            for (const auto & tc : mmap_copies) {
+                load_chunks.push_back({ tc.first->data, tc.second, ggml_nbytes(tc.first) });
+            }
+        }
+
+        if (!load_chunks.empty()) {
+            const int64_t t_start_read_us = ggml_time_us();
+
+            size_t size_read = 0;
+            for (const auto & chunk : load_chunks) {
+                size_read += chunk.size;
+            }
+
+            if (!whisper_model_load_chunks(model, load_chunks, wctx.params.n_threads_load)) {
+                WHISPER_LOG_ERROR("%s: failed to read the tensor data from the model file\n", __func__);
+                return false;
+            }
+
+            WHISPER_LOG_INFO("%s: read %.2f MB of tensor data with %d threads in %.2f ms\n", __func__,
+                    size_read / 1e6, std::max(1, wctx.params.n_threads_load), (ggml_time_us() - t_start_read_us) / 1000.0f);
+        }
+
+        WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
+
+        if (model.n_loaded == 0) {
+            WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
+        } else if (model.n_loaded != (int) model.tensors.size()) {
+            WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
+            return false;
+        }
+    }
+
+    for (auto & buf : model.buffers) {
+        ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+    }
+
+    wctx.t_load_us = ggml_time_us() - t_start_us;
+
+    return true;
+}
+
+static bool whisper_encode_external(const whisper_state & wstate) {
+    GGML_UNUSED(wstate);
+
+#ifndef WHISPER_USE_COREML
+    const bool use_coreml = false;
+#else
+    const bool use_coreml = wstate.ctx_coreml != nullptr;
+#endif
+
+#ifndef WHISPER_USE_OPENVINO
+    const bool use_openvino = false;
+#else
     const bool use_openvino = wstate.ctx_openvino != nullptr;
 #endif
 
     return use_coreml || use_openvino;
 }
 
+//
+// vectors of 4 and 8 floats / ints, which the compiler maps to the vector registers of the target (SSE / NEON, AVX)
+// whisper.cpp is compiled for the baseline of the target, the kernels which use them have an AVX2 + FMA clone on x86
+//
+#if defined(__GNUC__)
+#define WHISPER_VEC_INLINE inline __attribute__((always_inline))
+
+typedef float   whisper_v4f __attribute__((vector_size(16)));
+typedef float   whisper_v8f __attribute__((vector_size(32)));
+typedef int32_t whisper_v4i __attribute__((vector_size(16)));
+typedef int32_t whisper_v8i __attribute__((vector_size(32)));
+#define WHISPER_VEC
+#else
+#define WHISPER_VEC_INLINE inline
+
+typedef float   whisper_v4f;
+typedef float   whisper_v8f;
+typedef int32_t whisper_v4i;
+typedef int32_t whisper_v8i;
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(__AVX2__)
+#define WHISPER_VEC_AVX2_CLONE
+#endif
+
+//
+// fused convolution + bias + GELU of the encoder front-end on the CPU
+//
+// the two 1d convolutions (kernel size 3, padding 1) are computed directly from their input instead of
+// through the im2col intermediate of ggml_conv_1d_ph, and the bias and the GELU are applied to the tiles
+// of the result while they are still in the registers
+//
+// the stride-1 convolution stores its result with the even time steps first and the odd time steps second,
+// such that the stride-2 convolution reads the 3 inputs of each of its time steps from contiguous memory
+//
+
+#define WHISPER_CONV_OB 4  // output channels per tile
+#define WHISPER_CONV_TB 16 // time steps per tile
+#define WHISPER_CONV_TC 8  // tiles per chunk of time steps
+
+static const whisper_conv_params whisper_conv_1_params = { 1, true  };
+static const whisper_conv_params whisper_conv_2_params = { 2, false };
+
+// the input of kernel position k for time step t of a row of the input is x_k[t + off_k], with 0 <= t + off_k < len_k
+struct whisper_conv_input {
+    int64_t offs[3]; // offset of x_k in a row of the input
+    int64_t off [3];
+    int64_t len [3];
+};
+
+static whisper_conv_input whisper_conv_input_init(int stride, int64_t n_in) {
+    if (stride == 1) {
+        return { { 0, 0, 0 }, { -1, 0, 1 }, { n_in, n_in, n_in } };
+    }
+
+    // stride 2 on an input with the even time steps first: x[2t - 1] = odd[t - 1], x[2t] = even[t], x[2t + 1] = odd[t]
+    const int64_t n_half = n_in/2;
+
+    return { { n_half, 0, n_half }, { -1, 0, 0 }, { n_half, n_half, n_half } };
+}
+
+// GELU with a rational approximation of tanh which vectorizes, see ggml_gelu_f32
+static WHISPER_VEC_INLINE float whisper_conv_gelu(float x) {
+    const float y = std::min(std::max(0.79788456080286535587989211986876f*x*(1.0f + 0.044715f*x*x), -7.90531110763549805f), 7.90531110763549805f);
+    const float y2 = y*y;
+
+    float p = -2.76076847742355e-16f;
+    p = p*y2 + 2.00018790482477e-13f;
+    p = p*y2 - 8.60467152213735e-11f;
+    p = p*y2 + 5.12229709037114e-08f;
+    p = p*y2 + 1.48572235717979e-05f;
+    p = p*y2 + 6.37261928875436e-04f;
+    p = p*y2 + 4.89352455891786e-03f;
+
+    float q = 1.19825839466702e-06f;
+    q = q*y2 + 1.18534705686654e-04f;
+    q = q*y2 + 2.26843463243900e-03f;
+    q = q*y2 + 4.89352518554385e-03f;
+
+    return 0.5f*x*(1.0f + y*p/q);
+}
+
+// output channels [oc0, oc0 + WHISPER_CONV_OB) of the time steps [t0, t0 + WHISPER_CONV_TB) which only use inputs inside the rows
+template <typename V>
+static WHISPER_VEC_INLINE void whisper_conv_tile(
+        const float * wt, const float * x, int64_t nb_x, int64_t n_ic, const whisper_conv_input & inp, int64_t t0,
+        float sum[WHISPER_CONV_OB][WHISPER_CONV_TB]) {
+    const float * x0 = x + inp.offs[0] + t0 + inp.off[0];
+    const float * x1 = x + inp.offs[1] + t0 + inp.off[1];
+    const float * x2 = x + inp.offs[2] + t0 + inp.off[2];
+
+#if defined(WHISPER_VEC)
+    constexpr int nl = sizeof(V)/sizeof(float);
+    constexpr int nv = WHISPER_CONV_TB/nl;
+
+    // accumulate in local vectors such that they stay in the registers
+    V acc[WHISPER_CONV_OB][nv] = {};
+
+    for (int64_t ic = 0; ic < n_ic; ++ic) {
+        const float * wk = wt + ic*3*WHISPER_CONV_OB;
+
+        V v0[nv];
+        V v1[nv];
+        V v2[nv];
+        for (int j = 0; j < nv; ++j) {
+            memcpy(&v0[j], x0 + nl*j, sizeof(V));
+            memcpy(&v1[j], x1 + nl*j, sizeof(V));
+            memcpy(&v2[j], x2 + nl*j, sizeof(V));
+        }
+
+        for (int o = 0; o < WHISPER_CONV_OB; ++o) {
+            const float w0 = wk[0*WHISPER_CONV_OB + o];
+            const float w1 = wk[1*WHISPER_CONV_OB + o];
+            const float w2 = wk[2*WHISPER_CONV_OB + o];
+
+            for (int j = 0; j < nv; ++j) {
+                acc[o][j] += v0[j]*w0 + v1[j]*w1 + v2[j]*w2;
+            }
+        }
+
+        x0 += nb_x;
+        x1 += nb_x;
+        x2 += nb_x;
+    }
+
+    for (int o = 0; o < WHISPER_CONV_OB; ++o) {
+        memcpy(sum[o], acc[o], sizeof(acc[o]));
+    }
+#else
+    float acc[WHISPER_CONV_OB][WHISPER_CONV_TB] = {};
+
+    for (int64_t ic = 0; ic < n_ic; ++ic) {
+        const float * wk = wt + ic*3*WHISPER_CONV_OB;
+
+        for (int o = 0; o < WHISPER_CONV_OB; ++o) {
+            const float w0 = wk[0*WHISPER_CONV_OB + o];
+            const float w1 = wk[1*WHISPER_CONV_OB + o];
+            const float w2 = wk[2*WHISPER_CONV_OB + o];
+
+            for (int t = 0; t < WHISPER_CONV_TB; ++t) {
+                acc[o][t] += w0*x0[t] + w1*x1[t] + w2*x2[t];
+            }
+        }
+
+        x0 += nb_x;
+        x1 += nb_x;
+        x2 += nb_x;
+    }
+
+    memcpy(sum, acc, sizeof(acc));
+#endif
+}
+
+// output channels [oc0, oc0 + WHISPER_CONV_OB) of a single time step at the borders of the rows
+static WHISPER_VEC_INLINE void whisper_conv_step(
+        const float * wt, const float * x, int64_t nb_x, int64_t n_ic, const whisper_conv_input & inp, int64_t t,
+        float sum[WHISPER_CONV_OB]) {
+    for (int o = 0; o < WHISPER_CONV_OB; ++o) {
+        sum[o] = 0.0f;
+    }
+
+    for (int64_t ic = 0; ic < n_ic; ++ic) {
+        for (int k = 0; k < 3; ++k) {
+            const int64_t i = t + inp.off[k];
+            if (i < 0 || i >= inp.len[k]) {
+                continue;
+            }
+
+            const float xk = x[ic*nb_x + inp.offs[k] + i];
+            for (int o = 0; o < WHISPER_CONV_OB; ++o) {
+                sum[o] += wt[(ic*3 + k)*WHISPER_CONV_OB + o]*xk;
+            }
+        }
+    }
+}
+
+// computes the output channels [oc0, oc1) with the weights wt converted to F32 in tiles of [n_ic][3][WHISPER_CONV_OB]
+template <typename V>
+static WHISPER_VEC_INLINE void whisper_conv_rows_impl(
+        const float * wt, const float * x, const float * b, float * y, int64_t oc0, int64_t oc1,
+        int64_t n_ic, int64_t n_in, int64_t n_out, const whisper_conv_params & cp) {
+    const whisper_conv_input inp = whisper_conv_input_init(cp.stride, n_in);
+
+    // the time steps [t_begin, t_end) only use inputs inside the rows
+    int64_t t_begin = 0;
+    int64_t t_end   = n_out;
+    for (int k = 0; k < 3; ++k) {
+        t_begin = std::max(t_begin, -inp.off[k]);
+        t_end   = std::min(t_end, inp.len[k] - inp.off[k]);
+    }
+    const int64_t n_tiles = std::max<int64_t>(0, t_end - t_begin)/WHISPER_CONV_TB;
+
+    const int64_t n_half = n_out/2;
+
+    auto store = [&](int64_t oc, int64_t t, float v) {
+        v = whisper_conv_gelu(v + b[oc]);
+        y[oc*n_out + (cp.split_out ? (t % 2)*n_half + t/2 : t)] = v;
+    };
+
+    float sum[WHISPER_CONV_OB][WHISPER_CONV_TB];
+
+    for (int64_t tile0 = 0; tile0 < n_tiles; tile0 += WHISPER_CONV_TC) {
+        const int64_t tile1 = std::min(n_tiles, tile0 + WHISPER_CONV_TC);
+
+        for (int64_t oc = oc0; oc < oc1; oc += WHISPER_CONV_OB) {
+            const float * wt_oc = wt + (oc - oc0)*n_ic*3;
+
+            for (int64_t tile = tile0; tile < tile1; ++tile) {
+                const int64_t t0 = t_begin + tile*WHISPER_CONV_TB;
+
+                whisper_conv_tile<V>(wt_oc, x, n_in, n_ic, inp, t0, sum);
+
+                for (int o = 0; o < WHISPER_CONV_OB; ++o) {
+                    for (int t = 0; t < WHISPER_CONV_TB; ++t) {
+                        store(oc + o, t0 + t, sum[o][t]);
+                    }
+                }
+            }
+        }
+    }
+
+    // the time steps at the borders of the rows
+    for (int64_t t = 0; t < n_out; ++t) {
+        if (t == t_begin) {
+            t = t_begin + n_tiles*WHISPER_CONV_TB;
+            if (t >= n_out) {
+                break;
+            }
+        }
+
+        for (int64_t oc = oc0; oc < oc1; oc += WHISPER_CONV_OB) {
+            whisper_conv_step(wt + (oc - oc0)*n_ic*3, x, n_in, n_ic, inp, t, sum[0]);
+
+            for (int o = 0; o < WHISPER_CONV_OB; ++o) {
+                store(oc + o, t, sum[0][o]);
+            }
+        }
+    }
+}
+
+static void whisper_conv_rows(
+        const float * wt, const float * x, const float * b, float * y, int64_t oc0, int64_t oc1,
+        int64_t n_ic, int64_t n_in, int64_t n_out, const whisper_conv_params & cp) {
+    whisper_conv_rows_impl<whisper_v4f>(wt, x, b, y, oc0, oc1, n_ic, n_in, n_out, cp);
+}
+
+#if defined(WHISPER_VEC_AVX2_CLONE)
+// the same kernel compiled for AVX2 + FMA, used if the CPU supports it
+__attribute__((target("avx2,fma")))
+static void whisper_conv_rows_avx2(
+        const float * wt, const float * x, const float * b, float * y, int64_t oc0, int64_t oc1,
+        int64_t n_ic, int64_t n_in, int64_t n_out, const whisper_conv_params & cp) {
+    whisper_conv_rows_impl<whisper_v8f>(wt, x, b, y, oc0, oc1, n_ic, n_in, n_out, cp);
+}
+#define WHISPER_CONV_AVX2
+#endif
+
+// dst = gelu(conv_1d(w, x) + b), args: w [3, n_ic, n_oc] (F16 or F32), x [n_in, n_ic] (F32), b [1, n_oc] (F32)
+// the weights are read from their tiled F32 copy in the whisper_conv_weights of the userdata
+static void whisper_conv_custom(ggml_tensor * dst, int ith, int nth, void * userdata) {
+    const auto & cw = *(const whisper_conv_weights *) userdata;
+    const auto & cp = cw.params;
+
+    const ggml_tensor * w = dst->src[0];
+    const ggml_tensor * x = dst->src[1];
+    const ggml_tensor * b = dst->src[2];
+
+    const int64_t n_ic  = w->ne[1];
+    const int64_t n_oc  = w->ne[2];
+    const int64_t n_in  = x->ne[0];
+    const int64_t n_out = dst->ne[0];
+
+    // each thread computes a range of tiles of output channels
+    const int64_t n_blocks = n_oc/WHISPER_CONV_OB;
+    const int64_t oc0 = (n_blocks*ith/nth)*WHISPER_CONV_OB;
+    const int64_t oc1 = (n_blocks*(ith + 1)/nth)*WHISPER_CONV_OB;
+    if (oc0 >= oc1) {
+        return;
+    }
+
+    const float * wt = cw.wt.data() + oc0*n_ic*3;
+
+#ifdef WHISPER_CONV_AVX2
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        whisper_conv_rows_avx2(wt, (const float *) x->data, (const float *) b->data, (float *) dst->data, oc0, oc1, n_ic, n_in, n_out, cp);
+        return;
+    }
+#endif
+
+    whisper_conv_rows(wt, (const float *) x->data, (const float *) b->data, (float *) dst->data, oc0, oc1, n_ic, n_in, n_out, cp);
+}
+
+// the fused convolution is used if the weights are in F16 or F32 in a CPU buffer
+// and the compiler has vector extensions, other compilers keep the im2col path
+static bool whisper_conv_supported(const ggml_tensor * w, const ggml_tensor * b) {
+#if defined(WHISPER_VEC)
+    return (w->type == GGML_TYPE_F16 || w->type == GGML_TYPE_F32) && ggml_is_contiguous(w) && w->ne[0] == 3 && w->ne[2] % WHISPER_CONV_OB == 0 &&
+        b->type == GGML_TYPE_F32 && ggml_is_contiguous(b) && ggml_nelements(b) == w->ne[2] &&
+        w->buffer && ggml_backend_buffer_is_host(w->buffer) && b->buffer && ggml_backend_buffer_is_host(b->buffer);
+#else
+    GGML_UNUSED(w);
+    GGML_UNUSED(b);
+    return false;
+#endif
+}
+
+// converts the weights of a convolution once to the tiled F32 layout of the fused convolution, if it is supported
+static void whisper_conv_init(whisper_conv_weights & cw, const whisper_conv_params & cp, const ggml_tensor * w, const ggml_tensor * b) {
+    cw.params = cp;
+    cw.wt.clear();
+
+    if (!whisper_conv_supported(w, b)) {
+        return;
+    }
+
+    const int64_t n_ic = w->ne[1];
+    const int64_t n_oc = w->ne[2];
+
+    cw.wt.resize(n_oc*n_ic*3);
+
+    std::vector<float> row(n_ic*3);
+
+    for (int64_t oc = 0; oc < n_oc; ++oc) {
+        const char * w_oc = (const char *) w->data + oc*w->nb[2];
+        if (w->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) w_oc, row.data(), n_ic*3);
+        } else {
+            memcpy(row.data(), w_oc, n_ic*3*sizeof(float));
+        }
+
+        float * wt_oc = cw.wt.data() + (oc/WHISPER_CONV_OB)*n_ic*3*WHISPER_CONV_OB + oc % WHISPER_CONV_OB;
+        for (int64_t i = 0; i < n_ic*3; ++i) {
+            wt_oc[i*WHISPER_CONV_OB] = row[i];
+        }
+    }
+}
+
+static ggml_tensor * whisper_conv_fused(ggml_context * ctx, ggml_tensor * w, ggml_tensor * x, ggml_tensor * b, const whisper_conv_weights & cw) {
+    ggml_tensor * args[3] = { w, x, b };
+
+    // the userdata of ggml_custom_4d is not const, whisper_conv_custom only reads it
+    return ggml_custom_4d(ctx, GGML_TYPE_F32, x->ne[0]/cw.params.stride, w->ne[2], 1, 1, args, 3, whisper_conv_custom, GGML_N_TASKS_MAX, const_cast<whisper_conv_weights *>(&cw));
+}
+
 static struct ggml_cgraph * whisper_build_graph_conv(
         whisper_context & wctx,
           whisper_state & wstate) {
@@ -1998,7 +3425,10 @@ static struct ggml_cgraph * whisper_build_graph_conv(
 
     if (!whisper_encode_external(wstate)) {
         // convolution + gelu
-        {
+        if (!model.e_conv_1_fused.wt.empty() && !model.e_conv_2_fused.wt.empty()) {
+            cur = whisper_conv_fused(ctx0, model.e_conv_1_w, mel, model.e_conv_1_b, model.e_conv_1_fused);
+            cur = whisper_conv_fused(ctx0, model.e_conv_2_w, cur, model.e_conv_2_b, model.e_conv_2_fused);
+        } else {
             cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
             cur = ggml_add(ctx0, cur, model.e_conv_1_b);
 
@@ -2265,9 +3695,11 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 }
 
 // pre-compute cross-attention memory
+// embd_enc_inp: read the encoder output from an input tensor "embd_enc" instead of the encoder graph (used by the encoder cache)
 static struct ggml_cgraph * whisper_build_graph_cross(
         whisper_context & wctx,
-          whisper_state & wstate) {
+          whisper_state & wstate,
+             const bool   embd_enc_inp = false) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
@@ -2289,7 +3721,15 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
     ggml_cgraph * gf = ggml_new_graph(ctx0);
 
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_enc);
+    struct ggml_tensor * cur = nullptr;
+
+    if (embd_enc_inp) {
+        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
+        ggml_set_name(cur, "embd_enc");
+        ggml_set_input(cur);
+    } else {
+        cur = ggml_view_tensor(ctx0, wstate.embd_enc);
+    }
 
     const float  Kscale = pow(float(n_state_head), -0.25);
 
@@ -2315,10 +3755,10 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
         if (wctx.params.flash_attn) {
             k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx_pad));
+                    ggml_row_size(wstate.kv_cross.k->type, n_state)*(il*n_ctx_pad));
 
             v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*n_ctx_pad));
+                    ggml_row_size(wstate.kv_cross.v->type, n_state)*(il*n_ctx_pad));
         } else {
             Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
 
@@ -2360,6 +3800,52 @@ static bool whisper_encode_internal(
                    void * abort_callback_data) {
     const int64_t t_start_us = ggml_time_us();
 
+    whisper_encoder_key key;
+    key.mel_hash   = wstate.mel.hash;
+    key.mel_offset = mel_offset;
+    key.n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    if (key.mel_hash != 0 && key == wstate.kv_cross_key) {
+        WHISPER_LOG_DEBUG("%s: reusing the cross-attention KV cache for offset %d\n", __func__, mel_offset);
+        wstate.n_encode_cached++;
+        return !(abort_callback && abort_callback(abort_callback_data));
+    }
+
+    wstate.kv_cross_key = {};
+
+    // encoder output of this window is cached - only compute the cross-attention KV cache
+    if (key.mel_hash != 0 && wstate.enc_cache.size_max > 0) {
+        const std::vector<float> * embd_enc = whisper_encoder_cache_get(wstate.enc_cache, key);
+
+        if (embd_enc) {
+            WHISPER_LOG_DEBUG("%s: using the cached encoder output for offset %d\n", __func__, mel_offset);
+
+            auto & sched = wstate.sched_cross.sched;
+
+            ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate, true);
+
+            if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+                return false;
+            }
+
+            struct ggml_tensor * inp = ggml_graph_get_tensor(gf, "embd_enc");
+            WHISPER_ASSERT(ggml_nbytes(inp) == embd_enc->size()*sizeof(float));
+
+            ggml_backend_tensor_set(inp, embd_enc->data(), 0, ggml_nbytes(inp));
+
+            if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+                return false;
+            }
+
+            wstate.kv_cross_key = key;
+
+            wstate.t_encode_us += ggml_time_us() - t_start_us;
+            wstate.n_encode_cached++;
+
+            return !(abort_callback && abort_callback(abort_callback_data));
+        }
+    }
+
     // conv
     {
         auto & sched = wstate.sched_conv.sched;
@@ -2429,6 +3915,13 @@ static bool whisper_encode_internal(
         }
     }
 
+    if (key.mel_hash != 0 && wstate.enc_cache.size_max > 0) {
+        std::vector<float> embd_enc(ggml_nelements(wstate.embd_enc));
+        ggml_backend_tensor_get(wstate.embd_enc, embd_enc.data(), 0, ggml_nbytes(wstate.embd_enc));
+
+        whisper_encoder_cache_put(wstate.enc_cache, key, std::move(embd_enc));
+    }
+
     // cross
     {
         auto & sched = wstate.sched_cross.sched;
@@ -2445,6 +3938,8 @@ static bool whisper_encode_internal(
         }
     }
 
+    wstate.kv_cross_key = key;
+
     wstate.t_encode_us += ggml_time_us() - t_start_us;
     wstate.n_encode++;
 
@@ -2476,8 +3971,7 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
     const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
 
-    const int32_t n_kv    = worst_case ? n_ctx            : kv_self.n;
-    const int32_t kv_head = worst_case ? n_ctx - n_tokens : kv_self.head;
+    const int32_t n_kv = worst_case ? n_ctx : kv_self.n;
 
     //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
 
@@ -2507,6 +4001,19 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
     struct ggml_tensor * KQ_mask_f16 = ggml_cast(ctx0, KQ_mask, GGML_TYPE_F16);
 
+    // the KV cache cells of the tokens, such that the graph does not depend on where the batch is stored in the cache
+    struct ggml_tensor * kv_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(kv_idxs, "kv_idxs");
+    ggml_set_input(kv_idxs);
+
+    // the V cache is transposed without flash attention: one index per element
+    struct ggml_tensor * kv_idxs_v = nullptr;
+    if (!wctx.params.flash_attn) {
+        kv_idxs_v = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens*n_state);
+        ggml_set_name(kv_idxs_v, "kv_idxs_v");
+        ggml_set_input(kv_idxs_v);
+    }
+
     // token encoding + position encoding
     struct ggml_tensor * cur =
         ggml_add(ctx0,
@@ -2562,28 +4069,25 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                             Vcur,
                             layer.attn_v_b);
 
-                struct ggml_tensor * k;
-                struct ggml_tensor * v;
+                struct ggml_tensor * k = ggml_view_2d(ctx0, kv_self.k, n_state, n_ctx,
+                        ggml_row_size(kv_self.k->type, n_state),
+                        ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
+
+                ggml_build_forward_expand(gf, ggml_set_rows(ctx0, k, Kcur, kv_idxs));
 
                 if (wctx.params.flash_attn) {
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                    struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_state, n_ctx,
+                            ggml_row_size(kv_self.v->type, n_state),
+                            ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
 
-                    v = ggml_view_1d(ctx0, kv_self.v, n_tokens*n_state,
-                            (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
+                    ggml_build_forward_expand(gf, ggml_set_rows(ctx0, v, Vcur, kv_idxs));
                 } else {
-                    Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
-
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                    struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, 1, n_ctx*n_state,
+                            ggml_element_size(kv_self.v),
+                            ggml_element_size(kv_self.v)*n_ctx*n_state*il);
 
-                    v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
-                            (   n_ctx)*ggml_element_size(kv_self.v),
-                            (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+                    ggml_build_forward_expand(gf, ggml_set_rows(ctx0, v, ggml_reshape_2d(ctx0, Vcur, 1, n_state*n_tokens), kv_idxs_v));
                 }
-
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
             }
 
             // ------
@@ -2596,17 +4100,17 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
             struct ggml_tensor * K =
                 ggml_view_3d(ctx0, kv_self.k,
                         n_state_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+                        ggml_row_size(kv_self.k->type, n_state),
+                        ggml_row_size(kv_self.k->type, n_state_head),
+                        ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
 
             if (wctx.params.flash_attn) {
                 struct ggml_tensor * V =
                     ggml_view_3d(ctx0, kv_self.v,
                             n_state_head, n_kv, n_head,
-                            ggml_element_size(kv_self.v)*n_state,
-                            ggml_element_size(kv_self.v)*n_state_head,
-                            ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+                            ggml_row_size(kv_self.v->type, n_state),
+                            ggml_row_size(kv_self.v->type, n_state_head),
+                            ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, 1.0f, 0.0f, 0.0f);
 
@@ -2677,16 +4181,16 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 struct ggml_tensor * Kcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.k,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx_pad*il);
 
                 struct ggml_tensor * Vcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.v,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state,
-                            ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.v->type, n_state),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state)*n_audio_ctx_pad*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
 
@@ -2812,9 +4316,20 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     // might be useful in the future
     //cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    struct ggml_tensor * logits = nullptr;
 
-    // [EXPERIMENTAL] Token-level timestamps with DTW
+    if (wstate.vocab_prune && !wstate.vocab_active.empty() && !worst_case) {
+        // only project on the rows of the active vocabulary
+        struct ggml_tensor * vocab = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, wstate.vocab_active.size());
+        ggml_set_name(vocab, "vocab");
+        ggml_set_input(vocab);
+
+        logits = ggml_mul_mat(ctx0, ggml_get_rows(ctx0, model.d_te, vocab), cur);
+    } else {
+        logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    }
+
+    // [EXPERIMENTAL] Token-level timestamps with DTW
     if (wctx.params.dtw_token_timestamps && aheads_cross_QKs != nullptr) {
         aheads_cross_QKs = ggml_transpose(ctx0, aheads_cross_QKs);
         aheads_cross_QKs = ggml_cont(ctx0, aheads_cross_QKs);
@@ -2866,10 +4381,16 @@ static bool whisper_decode_internal(
         auto & kv_self = wstate.kv_self;
 
         if (!whisper_kv_cache_find_slot(kv_self, batch)) {
-            return false;
+            // the free cells may be fragmented - compact the cache and try again
+            whisper_kv_cache_defrag(kv_self, hparams.n_text_layer, !wctx.params.flash_attn);
+
+            if (!whisper_kv_cache_find_slot(kv_self, batch)) {
+                WHISPER_LOG_ERROR("%s: failed to find a KV cache slot for %d tokens\n", __func__, batch.n_tokens);
+                return false;
+            }
         }
 
-        const uint32_t pad = whisper_kv_cache_get_padding(wctx);
+        const uint32_t pad = std::max(whisper_kv_cache_get_padding(wctx), (uint32_t) WHISPER_KV_GRAPH_PAD);
         kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
 
         //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
@@ -2880,11 +4401,37 @@ static bool whisper_decode_internal(
     {
         auto & sched = wstate.sched_decode.sched;
 
-        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+        // reuse the graph of the previous batch if it has the same shape (e.g. the next token of greedy decoding)
+        whisper_decode_graph key;
+        key.n_tokens    = n_tokens;
+        key.n_kv        = wstate.kv_self.n;
+        key.n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+        key.n_logits    = wstate.vocab_prune && !wstate.vocab_active.empty() ? (int32_t) wstate.vocab_active.size() : n_vocab;
+        key.save_alignment_heads_QKs = save_alignment_heads_QKs && wctx.params.dtw_token_timestamps;
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
+        auto & cached = wstate.gf_decode;
+
+        ggml_cgraph * gf = cached.gf;
+
+        if (gf == nullptr ||
+            cached.n_tokens    != key.n_tokens    ||
+            cached.n_kv        != key.n_kv        ||
+            cached.n_audio_ctx != key.n_audio_ctx ||
+            cached.n_logits    != key.n_logits    ||
+            cached.save_alignment_heads_QKs != key.save_alignment_heads_QKs) {
+            cached.gf = nullptr;
+
+            ggml_backend_sched_reset(sched);
+
+            gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+
+            if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+                // should never happen as we pre-allocate the memory
+                return false;
+            }
+
+            key.gf = gf;
+            cached = key;
         }
 
         // set the inputs
@@ -2935,19 +4482,75 @@ static bool whisper_decode_internal(
             ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
         }
 
+        {
+            auto & kv_self = wstate.kv_self;
+
+            const int32_t n_ctx   = kv_self.size;
+            const int32_t n_state = hparams.n_text_state;
+
+            struct ggml_tensor * kv_idxs   = ggml_graph_get_tensor(gf, "kv_idxs");
+            struct ggml_tensor * kv_idxs_v = ggml_graph_get_tensor(gf, "kv_idxs_v");
+
+            // the batch is stored in the cells [head, head + n_tokens)
+            auto & idxs = wstate.inp_kv_idxs;
+            idxs.resize(kv_idxs_v ? n_tokens*n_state : n_tokens);
+
+            for (int i = 0; i < n_tokens; ++i) {
+                idxs[i] = kv_self.head + i;
+            }
+            ggml_backend_tensor_set(kv_idxs, idxs.data(), 0, n_tokens*sizeof(int32_t));
+
+            if (kv_idxs_v) {
+                for (int i = 0; i < n_tokens; ++i) {
+                    for (int d = 0; d < n_state; ++d) {
+                        idxs[i*n_state + d] = d*n_ctx + kv_self.head + i;
+                    }
+                }
+                ggml_backend_tensor_set(kv_idxs_v, idxs.data(), 0, n_tokens*n_state*sizeof(int32_t));
+            }
+        }
+
+        struct ggml_tensor * vocab = ggml_graph_get_tensor(gf, "vocab");
+        if (vocab) {
+            ggml_backend_tensor_set(vocab, wstate.vocab_active.data(), 0, ggml_nbytes(vocab));
+        }
+
         logits = ggml_graph_node(gf, -1);
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        // do not reset the scheduler - the graph may be reused for the next batch
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, false)) {
+            cached.gf = nullptr;
             return false;
         }
     }
 
     logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
-        if (batch.logits[i] == 0) {
-            continue;
+    if (logits->ne[0] < n_vocab) {
+        // active vocabulary: scatter the logits of the active tokens, the other tokens can not be sampled
+        const int n_active = logits->ne[0];
+
+        auto & logits_active = wstate.logits_active;
+        logits_active.resize(n_active);
+
+        for (int i = 0; i < n_tokens; i++) {
+            if (batch.logits[i] == 0) {
+                continue;
+            }
+            ggml_backend_tensor_get(logits, logits_active.data(), sizeof(float)*(n_active*i), sizeof(float)*n_active);
+
+            float * out = logits_out.data() + n_vocab*i;
+            std::fill(out, out + n_vocab, -INFINITY);
+            for (int k = 0; k < n_active; ++k) {
+                out[wstate.vocab_active[k]] = logits_active[k];
+            }
+        }
+    } else {
+        for (int i = 0; i < n_tokens; i++) {
+            if (batch.logits[i] == 0) {
+                continue;
+            }
+            ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
         }
-        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
     }
 
     if (batch.n_tokens > 1) {
@@ -3239,6 +4842,8 @@ static bool log_mel_spectrogram(
         mel.data[i] = (mel.data[i] + 4.0)/4.0;
     }
 
+    mel.hash = whisper_mel_hash(mel);
+
     wstate.t_mel_us += ggml_time_us() - t_start_us;
 
     // Dump log_mel_spectrogram
@@ -3265,51 +4870,101 @@ static bool log_mel_spectrogram(
 // Regex (C++):
 // R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
 //
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+// the end of the word starting at p, splitting the text into words the same way as the GPT-2 pre-tokenizer regex
+//   's|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+
+// with the character classes of the "C" locale (bytes of UTF-8 characters are neither letters nor digits)
+static size_t whisper_pretokenize(const std::string & text, size_t p) {
+    const size_t n = text.size();
+
+    // 0: letter, 1: digit, 2: other, -1: whitespace
+    auto char_class = [](char c) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+            return 0;
+        }
+        if (c >= '0' && c <= '9') {
+            return 1;
+        }
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r') {
+            return -1;
+        }
+        return 2;
+    };
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+    // 's|'t|'re|'ve|'m|'ll|'d
+    if (text[p] == '\'' && p + 1 < n) {
+        const char c = text[p + 1];
+        if (c == 's' || c == 't' || c == 'm' || c == 'd') {
+            return p + 2;
+        }
+        if (p + 2 < n && ((c == 'r' && text[p + 2] == 'e') || (c == 'v' && text[p + 2] == 'e') || (c == 'l' && text[p + 2] == 'l'))) {
+            return p + 3;
+        }
+    }
 
-        std::regex re(pat);
-        std::smatch m;
+    // ' ?[[:alpha:]]+', ' ?[[:digit:]]+' or ' ?[^\s[:alpha:][:digit:]]+'
+    const size_t q = text[p] == ' ' ? p + 1 : p;
+    if (q < n && char_class(text[q]) >= 0) {
+        const int cls = char_class(text[q]);
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
+        size_t e = q + 1;
+        while (e < n && char_class(text[e]) == cls) {
+            ++e;
         }
+        return e;
     }
 
-    // find the longest tokens that form the words:
+    // '\s+(?!\S)': the whitespace except the last one before the next word, else '\s+'
+    size_t e = p + 1;
+    while (e < n && char_class(text[e]) < 0) {
+        ++e;
+    }
+    if (e < n && e - p > 1) {
+        return e - 1;
+    }
+
+    return e;
+}
+
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
     std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
 
-        int i = 0;
-        int n = word.size();
+    const auto & trie = vocab.trie;
+
+    // split the text into words and find the longest tokens that form the words, walking the trie from the root
+    for (size_t p = 0; p < text.size(); ) {
+        const size_t n = whisper_pretokenize(text, p);
+
+        size_t i = p;
         while (i < n) {
-            int j = n;
-            bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    found = true;
+            whisper_vocab::id token = -1;
+            size_t j_token = i;
+
+            uint32_t node = 0;
+            for (size_t j = i; j < n; ++j) {
+                const uint8_t * e0 = vocab.trie_edge_byte.data() + trie[node].edge_begin;
+                const uint8_t * e1 = vocab.trie_edge_byte.data() + trie[node].edge_end;
+                const uint8_t * e  = std::lower_bound(e0, e1, (uint8_t) text[j]);
+                if (e == e1 || *e != (uint8_t) text[j]) {
                     break;
                 }
-                --j;
+
+                node = vocab.trie_edge_node[e - vocab.trie_edge_byte.data()];
+                if (trie[node].token >= 0) {
+                    token   = trie[node].token;
+                    j_token = j + 1;
+                }
             }
-            if (!found) {
+
+            if (token >= 0) {
+                tokens.push_back(token);
+                i = j_token;
+            } else {
                 WHISPER_LOG_ERROR("unknown token\n");
                 ++i;
             }
         }
+
+        p = n;
     }
 
     return tokens;
@@ -3379,8 +5034,10 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
     // at this point, we don't know yet how many decoders will be used
     // later during decoding, if more decoders are used, we will recreate the KV cache respectively
+    state->enc_cache.size_max = ctx->params.enc_cache_size;
+
     state->kv_self_n_dec = 1;
-    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->params.type_kv,
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
                 GGML_PAD(ctx->model.hparams.n_text_ctx, 256))) {
@@ -3390,11 +5047,11 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     }
 
     {
-        const size_t memory_size = ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v);
+        const size_t memory_size = whisper_kv_cache_nbytes(state->kv_self);
         WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
     }
 
-    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], ctx->params.type_kv,
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
                 GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
@@ -3404,7 +5061,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     }
 
     {
-        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
+        const size_t memory_size = whisper_kv_cache_nbytes(state->kv_cross);
         WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
     }
 
@@ -3418,7 +5075,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     }
 
     {
-        const size_t memory_size = ggml_nbytes(state->kv_pad.k) + ggml_nbytes(state->kv_pad.v);
+        const size_t memory_size = whisper_kv_cache_nbytes(state->kv_pad);
         WHISPER_LOG_INFO("%s: kv pad  size  = %7.2f MB\n", __func__, memory_size / 1e6);
     }
 
@@ -3461,7 +5118,6 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     state->decoders[0].probs.reserve    (ctx->vocab.n_vocab);
     state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
     state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
-    state->decoders[0].logits_id.reserve(ctx->model.hparams.n_vocab);
 
     state->decoders[0].rng = std::mt19937(0);
 
@@ -3604,6 +5260,11 @@ struct whisper_context_params whisper_context_default_params() {
         /*.use_gpu              =*/ true,
         /*.flash_attn           =*/ true,
         /*.gpu_device           =*/ 0,
+        /*.type_kv              =*/ GGML_TYPE_F16,
+        /*.enc_cache_size       =*/ 0,
+        /*.use_mmap             =*/ false,
+        /*.n_threads_load       =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.use_extra_bufts      =*/ true,
 
         /*.dtw_token_timestamps =*/ false,
         /*.dtw_aheads_preset    =*/ WHISPER_AHEADS_NONE,
@@ -3617,8 +5278,80 @@ struct whisper_context_params whisper_context_default_params() {
     return result;
 }
 
+static struct whisper_context * whisper_init_with_params_no_state_impl(struct whisper_model_loader * loader, struct whisper_context_params params, const char * path_model, std::unique_ptr<whisper_mmap> mapping, whisper_file_reader * file_reader);
+
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
+
+    if (params.use_mmap) {
+        std::unique_ptr<whisper_mmap> mapping(new whisper_mmap(path_model));
+
+        if (mapping->valid()) {
+            whisper_mmap_reader reader;
+            reader.mapping = mapping.get();
+
+            whisper_model_loader loader = {};
+
+            loader.context = &reader;
+
+            loader.read = [](void * ctx, void * output, size_t read_size) {
+                whisper_mmap_reader * reader = (whisper_mmap_reader *) ctx;
+
+                const size_t n_left = reader->mapping->size - std::min(reader->pos, reader->mapping->size);
+                const size_t n_read = std::min(read_size, n_left);
+
+                memcpy(output, (const char *) reader->mapping->addr + reader->pos, n_read);
+                if (n_read < read_size) {
+                    // same as std::ifstream: eof is set after an attempt to read past the end
+                    memset((char *) output + n_read, 0, read_size - n_read);
+                    reader->eof = true;
+                }
+                reader->pos += n_read;
+
+                return n_read;
+            };
+
+            loader.eof = [](void * ctx) {
+                whisper_mmap_reader * reader = (whisper_mmap_reader *) ctx;
+                return reader->eof;
+            };
+
+            loader.close = [](void * /*ctx*/) { };
+
+            return whisper_init_with_params_no_state_impl(&loader, params, path_model, std::move(mapping), nullptr);
+        }
+
+        WHISPER_LOG_WARN("%s: failed to mmap '%s' - reading the model file instead\n", __func__, path_model);
+    }
+
+#ifdef WHISPER_PARALLEL_LOAD
+    if (params.n_threads_load > 1) {
+        whisper_file_reader reader(path_model);
+        if (!reader.valid()) {
+            WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
+            return nullptr;
+        }
+
+        whisper_model_loader loader = {};
+
+        loader.context = &reader;
+
+        loader.read = [](void * ctx, void * output, size_t read_size) {
+            whisper_file_reader * reader = (whisper_file_reader *) ctx;
+            return reader->read(output, read_size);
+        };
+
+        loader.eof = [](void * ctx) {
+            whisper_file_reader * reader = (whisper_file_reader *) ctx;
+            return reader->eof;
+        };
+
+        loader.close = [](void * /*ctx*/) { };
+
+        return whisper_init_with_params_no_state_impl(&loader, params, path_model, nullptr, &reader);
+    }
+#endif
+
 #ifdef _MSC_VER
     // Convert UTF-8 path to wide string (UTF-16) for Windows, resolving character encoding issues.
     std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
@@ -3652,13 +5385,7 @@ struct whisper_context * whisper_init_from_file_with_params_no_state(const char
         fin->close();
     };
 
-    auto ctx = whisper_init_with_params_no_state(&loader, params);
-
-    if (ctx) {
-        ctx->path_model = path_model;
-    }
-
-    return ctx;
+    return whisper_init_with_params_no_state_impl(&loader, params, path_model, nullptr, nullptr);
 }
 
 struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * buffer, size_t buffer_size, struct whisper_context_params params) {
@@ -3699,6 +5426,10 @@ struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * bu
 }
 
 struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    return whisper_init_with_params_no_state_impl(loader, params, nullptr, nullptr, nullptr);
+}
+
+static struct whisper_context * whisper_init_with_params_no_state_impl(struct whisper_model_loader * loader, struct whisper_context_params params, const char * path_model, std::unique_ptr<whisper_mmap> mapping, whisper_file_reader * file_reader) {
     ggml_time_init();
 
     if (params.flash_attn && params.dtw_token_timestamps) {
@@ -3706,8 +5437,30 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
         params.dtw_token_timestamps = false;
     }
 
+    switch (params.type_kv) {
+        case GGML_TYPE_F16:
+            break;
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+            if (!params.flash_attn) {
+                WHISPER_LOG_WARN("%s: a quantized KV cache requires flash_attn - using f16\n", __func__);
+                params.type_kv = GGML_TYPE_F16;
+            }
+            break;
+        default:
+            WHISPER_LOG_WARN("%s: unsupported KV cache type '%s' - using f16\n", __func__, ggml_type_name(params.type_kv));
+            params.type_kv = GGML_TYPE_F16;
+            break;
+    }
+
     WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
     WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
+    WHISPER_LOG_INFO("%s: type kv    = %s\n", __func__, ggml_type_name(params.type_kv));
+    WHISPER_LOG_INFO("%s: use mmap   = %d\n", __func__, mapping != nullptr);
+    WHISPER_LOG_INFO("%s: extra buft = %d\n", __func__, params.use_extra_bufts);
     WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
     WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
     WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
@@ -3715,8 +5468,15 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
 
     whisper_context * ctx = new whisper_context;
     ctx->params = params;
+    ctx->path_model = path_model ? path_model : "";
+    ctx->model.mapping = std::move(mapping);
+    ctx->model.file_reader = file_reader;
+
+    const bool ok = whisper_model_load(loader, *ctx);
 
-    if (!whisper_model_load(loader, *ctx)) {
+    ctx->model.file_reader = nullptr;
+
+    if (!ok) {
         loader->close(loader->context);
         WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
         delete ctx;
@@ -3725,6 +5485,10 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
 
     loader->close(loader->context);
 
+    // the weights of the encoder convolutions are converted once for the fused convolution on the CPU
+    whisper_conv_init(ctx->model.e_conv_1_fused, whisper_conv_1_params, ctx->model.e_conv_1_w, ctx->model.e_conv_1_b);
+    whisper_conv_init(ctx->model.e_conv_2_fused, whisper_conv_2_params, ctx->model.e_conv_2_w, ctx->model.e_conv_2_b);
+
     return ctx;
 }
 
@@ -3740,61 +5504,577 @@ struct whisper_context * whisper_init_from_file_with_params(const char * path_mo
         return nullptr;
     }
 
-    return ctx;
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_buffer_with_params(void * buffer, size_t buffer_size, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, params);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_with_params(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_with_params_no_state(loader, params);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_file(const char * path_model) {
+    return whisper_init_from_file_with_params(path_model, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
+    return whisper_init_from_buffer_with_params(buffer, buffer_size, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
+    return whisper_init_with_params(loader, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
+    return whisper_init_from_file_with_params_no_state(path_model, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
+    return whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
+    return whisper_init_with_params_no_state(loader, whisper_context_default_params());
+}
+
+// model file in the ggml or GGUF format, which is rewritten to a GGUF model file
+// the metadata for the output file is collected in gguf, the tensor data is read from the input file one tensor at a time
+struct whisper_model_file {
+    struct tensor_info {
+        std::string name;
+        int32_t     n_dims;
+        int64_t     ne[4];
+        ggml_type   type;
+        size_t      offs;
+    };
+
+    std::ifstream fin;
+
+    gguf_context_ptr gguf;
+
+    std::vector<tensor_info> tensors;
+};
+
+static bool whisper_model_file_read_ggml(whisper_model_file & mf, const char * fname) {
+    auto & fin = mf.fin;
+
+    auto read_i32 = [&fin]() {
+        int32_t value = 0;
+        fin.read((char *) &value, sizeof(value));
+        return value;
+    };
+
+    gguf_set_val_str(mf.gguf.get(), WHISPER_GGUF_KEY_ARCH, "whisper");
+
+    // hparams
+    for (const char * key : WHISPER_GGUF_KEYS_HPARAMS) {
+        gguf_set_val_i32(mf.gguf.get(), key, read_i32());
+    }
+
+    // mel filters
+    {
+        const int32_t n_mel = read_i32();
+        const int32_t n_fft = read_i32();
+        if (n_mel < 0 || n_fft < 0) {
+            WHISPER_LOG_ERROR("%s: invalid mel filters in '%s'\n", __func__, fname);
+            return false;
+        }
+
+        std::vector<float> data((size_t) n_mel*n_fft);
+        fin.read((char *) data.data(), data.size()*sizeof(float));
+
+        gguf_set_val_i32 (mf.gguf.get(), WHISPER_GGUF_KEY_FILTERS_N_MEL, n_mel);
+        gguf_set_val_i32 (mf.gguf.get(), WHISPER_GGUF_KEY_FILTERS_N_FFT, n_fft);
+        gguf_set_arr_data(mf.gguf.get(), WHISPER_GGUF_KEY_FILTERS, GGUF_TYPE_FLOAT32, data.data(), data.size());
+    }
+
+    // vocab
+    {
+        const int32_t n_vocab = read_i32();
+
+        std::vector<uint32_t> lengths(std::max(0, n_vocab));
+        std::vector<uint8_t>  bytes;
+
+        for (auto & len : lengths) {
+            len = (uint32_t) read_i32();
+            if (!fin) {
+                break;
+            }
+
+            bytes.resize(bytes.size() + len);
+            fin.read((char *) bytes.data() + bytes.size() - len, len);
+        }
+
+        gguf_set_arr_data(mf.gguf.get(), WHISPER_GGUF_KEY_TOKEN_LENGTHS, GGUF_TYPE_UINT32, lengths.data(), lengths.size());
+        gguf_set_arr_data(mf.gguf.get(), WHISPER_GGUF_KEY_TOKEN_BYTES,   GGUF_TYPE_UINT8,  bytes.data(),   bytes.size());
+    }
+
+    if (!fin) {
+        WHISPER_LOG_ERROR("%s: failed to read the header of '%s'\n", __func__, fname);
+        return false;
+    }
+
+    // tensor headers and the position of the tensor data in the file
+    while (true) {
+        whisper_model_file::tensor_info info;
+
+        info.n_dims = read_i32();
+        const int32_t length = read_i32();
+        const int32_t ttype  = read_i32();
+
+        if (fin.eof()) {
+            break;
+        }
+
+        if (info.n_dims < 1 || info.n_dims > 4 || length <= 0 || length >= GGML_MAX_NAME || ttype < 0 || ttype >= GGML_TYPE_COUNT) {
+            WHISPER_LOG_ERROR("%s: invalid tensor header in '%s'\n", __func__, fname);
+            return false;
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            info.ne[i] = i < info.n_dims ? read_i32() : 1;
+        }
+
+        info.name.resize(length);
+        fin.read(&info.name[0], length);
+
+        info.type = (ggml_type) ttype;
+        info.offs = fin.tellg();
+
+        const size_t nbytes = ggml_row_size(info.type, info.ne[0])*info.ne[1]*info.ne[2]*info.ne[3];
+
+        fin.seekg(nbytes, std::ios::cur);
+        if (!fin) {
+            WHISPER_LOG_ERROR("%s: failed to read tensor '%s' from '%s'\n", __func__, info.name.c_str(), fname);
+            return false;
+        }
+
+        mf.tensors.push_back(info);
+    }
+
+    fin.clear();
+
+    return true;
+}
+
+static bool whisper_model_file_read_gguf(whisper_model_file & mf, const char * fname) {
+    ggml_context * meta = nullptr;
+
+    gguf_init_params gparams = {
+        /*.no_alloc =*/ true,
+        /*.ctx      =*/ &meta,
+    };
+
+    gguf_context_ptr gguf(gguf_init_from_file(fname, gparams));
+    if (!gguf) {
+        WHISPER_LOG_ERROR("%s: failed to read the metadata of '%s'\n", __func__, fname);
+        return false;
+    }
+    ggml_context_ptr gguf_meta(meta);
+
+    gguf_set_kv(mf.gguf.get(), gguf.get());
+
+    const size_t offs_data = gguf_get_data_offset(gguf.get());
+
+    for (int64_t i = 0; i < gguf_get_n_tensors(gguf.get()); ++i) {
+        const ggml_tensor * t = ggml_get_tensor(gguf_meta.get(), gguf_get_tensor_name(gguf.get(), i));
+
+        whisper_model_file::tensor_info info;
+
+        info.name   = gguf_get_tensor_name(gguf.get(), i);
+        info.n_dims = ggml_n_dims(t);
+        info.type   = t->type;
+        info.offs   = offs_data + gguf_get_tensor_offset(gguf.get(), i);
+        for (int j = 0; j < 4; ++j) {
+            info.ne[j] = t->ne[j];
+        }
+
+        mf.tensors.push_back(info);
+    }
+
+    return true;
+}
+
+static bool whisper_model_file_read(whisper_model_file & mf, const char * fname) {
+#if defined(WHISPER_BIG_ENDIAN)
+    WHISPER_LOG_ERROR("%s: not supported on big-endian systems\n", __func__);
+    return false;
+#endif
+
+    mf.fin = std::ifstream(fname, std::ios::binary);
+    if (!mf.fin) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+
+    mf.gguf.reset(gguf_init_empty());
+
+    uint32_t magic = 0;
+    mf.fin.read((char *) &magic, sizeof(magic));
+
+    if (memcmp(&magic, GGUF_MAGIC, sizeof(magic)) == 0) {
+        return whisper_model_file_read_gguf(mf, fname);
+    }
+
+    if (magic != GGML_FILE_MAGIC) {
+        WHISPER_LOG_ERROR("%s: '%s' is not a whisper model file (bad magic)\n", __func__, fname);
+        return false;
+    }
+
+    return whisper_model_file_read_ggml(mf, fname);
+}
+
+// convert nrows rows of n_per_row values of type type_inp to type_out with n_threads
+// the rows are split in parts of 32 rows, each part is converted to float in data_f32 and quantized
+static bool whisper_convert_rows(
+        ggml_type type_inp, const char * data_inp,
+        ggml_type type_out,       char * data_out,
+        float * data_f32, int64_t nrows, int64_t n_per_row, int n_threads) {
+    const int64_t nrows_part = 32;
+    const int64_t n_parts    = (nrows + nrows_part - 1)/nrows_part;
+
+    const auto * traits = ggml_get_type_traits(type_inp);
+    if (type_inp != GGML_TYPE_F32 && !traits->to_float) {
+        return false;
+    }
+
+    const size_t row_size_inp = ggml_row_size(type_inp, n_per_row);
+
+    std::atomic<int64_t> i_next(0);
+
+    auto worker = [&]() {
+        while (true) {
+            const int64_t i = i_next++;
+            if (i >= n_parts) {
+                break;
+            }
+
+            const int64_t row0 = i*nrows_part;
+            const int64_t n    = std::min(nrows_part, nrows - row0);
+
+            float * f32 = data_f32 + row0*n_per_row;
+
+            if (type_inp == GGML_TYPE_F32) {
+                memcpy(f32, data_inp + row0*row_size_inp, n*row_size_inp);
+            } else {
+                traits->to_float(data_inp + row0*row_size_inp, f32, n*n_per_row);
+            }
+
+            ggml_quantize_chunk(type_out, data_f32, data_out, row0*n_per_row, n, n_per_row, nullptr);
+        }
+    };
+
+    n_threads = std::max(1, std::min(n_threads, (int) n_parts));
+
+    std::vector<std::thread> workers(n_threads - 1);
+    for (auto & w : workers) {
+        w = std::thread(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    return true;
+}
+
+// write the model file as GGUF model file, with types[i] the type of tensor i in the output file
+// tensors with another type than in the input file are converted to float and quantized with n_threads
+// only 1 tensor is kept in memory at a time
+static bool whisper_model_file_write_gguf(whisper_model_file & mf, const char * fname, const std::vector<ggml_type> & types, int n_threads) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ (mf.tensors.size() + 1)*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context_ptr ctx(ggml_init(params));
+
+    for (size_t i = 0; i < mf.tensors.size(); ++i) {
+        const auto & info = mf.tensors[i];
+
+        ggml_tensor * tensor = ggml_new_tensor(ctx.get(), types[i], info.n_dims, info.ne);
+        ggml_set_name(tensor, info.name.c_str());
+        gguf_add_tensor(mf.gguf.get(), tensor);
+    }
+
+    auto fout = std::ofstream(fname, std::ios::binary);
+    if (!fout) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s' for writing\n", __func__, fname);
+        return false;
+    }
+
+    // metadata, padded up to the alignment of the tensor data
+    {
+        std::vector<char> meta(gguf_get_meta_size(mf.gguf.get()));
+        gguf_get_meta_data(mf.gguf.get(), meta.data());
+        fout.write(meta.data(), meta.size());
+    }
+
+    // tensor data, each tensor padded up to the alignment
+    const size_t alignment = gguf_get_alignment(mf.gguf.get());
+
+    std::vector<char>  data_inp;
+    std::vector<char>  data_out;
+    std::vector<float> data_f32;
+
+    size_t total_size_inp = 0;
+    size_t total_size_out = 0;
+
+    for (size_t i = 0; i < mf.tensors.size(); ++i) {
+        const auto & info = mf.tensors[i];
+
+        const int64_t n_per_row = info.ne[0];
+        const int64_t nrows     = info.ne[1]*info.ne[2]*info.ne[3];
+
+        const size_t nbytes_inp = ggml_row_size(info.type, n_per_row)*nrows;
+        const size_t nbytes_out = ggml_row_size(types[i],  n_per_row)*nrows;
+
+        data_inp.resize(nbytes_inp);
+
+        mf.fin.seekg(info.offs);
+        mf.fin.read(data_inp.data(), nbytes_inp);
+        if (!mf.fin) {
+            WHISPER_LOG_ERROR("%s: failed to read tensor '%s'\n", __func__, info.name.c_str());
+            return false;
+        }
+
+        data_out.resize(GGML_PAD(nbytes_out, alignment));
+        std::fill(data_out.begin() + nbytes_out, data_out.end(), 0);
+
+        if (types[i] == info.type) {
+            memcpy(data_out.data(), data_inp.data(), nbytes_inp);
+        } else {
+            data_f32.resize(n_per_row*nrows);
+
+            if (!whisper_convert_rows(info.type, data_inp.data(), types[i], data_out.data(), data_f32.data(), nrows, n_per_row, n_threads)) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' of type %s can not be converted\n", __func__, info.name.c_str(), ggml_type_name(info.type));
+                return false;
+            }
+
+            WHISPER_LOG_DEBUG("%s: %-40s %8s -> %8s\n", __func__, info.name.c_str(), ggml_type_name(info.type), ggml_type_name(types[i]));
+        }
+
+        fout.write(data_out.data(), data_out.size());
+
+        total_size_inp += nbytes_inp;
+        total_size_out += nbytes_out;
+    }
+
+    fout.close();
+    if (!fout) {
+        WHISPER_LOG_ERROR("%s: failed to write '%s'\n", __func__, fname);
+        return false;
+    }
+
+    WHISPER_LOG_INFO("%s: %zu tensors, %.2f MB -> %.2f MB\n", __func__, mf.tensors.size(), total_size_inp/1e6, total_size_out/1e6);
+
+    return true;
+}
+
+int whisper_model_convert_gguf(const char * fname_inp, const char * fname_out) {
+    WHISPER_LOG_INFO("%s: converting '%s' to '%s'\n", __func__, fname_inp, fname_out);
+
+    whisper_model_file mf;
+    if (!whisper_model_file_read(mf, fname_inp)) {
+        return 1;
+    }
+
+    std::vector<ggml_type> types;
+    for (const auto & info : mf.tensors) {
+        types.push_back(info.type);
+    }
+
+    if (!whisper_model_file_write_gguf(mf, fname_out, types, 1)) {
+        return 2;
+    }
+
+    return 0;
+}
+
+struct whisper_model_quantize_params whisper_model_quantize_default_params(void) {
+    struct whisper_model_quantize_params result = {
+        /*.type       =*/ GGML_TYPE_Q8_0,
+        /*.n_threads  =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.n_patterns =*/ 0,
+        /*.patterns   =*/ nullptr,
+        /*.types      =*/ nullptr,
+    };
+
+    return result;
 }
 
-struct whisper_context * whisper_init_from_buffer_with_params(void * buffer, size_t buffer_size, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, params);
-    if (!ctx) {
-        return nullptr;
+// the types which can be used for the weight matrices
+// the types which require an importance matrix (iq2_xxs, iq2_xs, iq1_s) are not supported, it is computed on calibration data
+static bool whisper_quantize_type_supported(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_F32:
+        case GGML_TYPE_F16:
+        case GGML_TYPE_BF16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q2_K:
+        case GGML_TYPE_Q3_K:
+        case GGML_TYPE_Q4_K:
+        case GGML_TYPE_Q5_K:
+        case GGML_TYPE_Q6_K:
+        case GGML_TYPE_IQ4_NL:
+        case GGML_TYPE_IQ4_XS:
+        case GGML_TYPE_IQ3_XXS:
+        case GGML_TYPE_IQ3_S:
+        case GGML_TYPE_IQ2_S:
+        case GGML_TYPE_IQ1_M:
+        case GGML_TYPE_TQ1_0:
+        case GGML_TYPE_TQ2_0:
+        case GGML_TYPE_MXFP4:
+            return true;
+        default:
+            return false;
     }
+}
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+// type to use if the rows of a tensor are not a multiple of the block size of the type (e.g. 256 for the k-quants)
+static ggml_type whisper_quantize_type_fallback(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_Q2_K:
+        case GGML_TYPE_Q3_K:
+        case GGML_TYPE_IQ4_XS:
+        case GGML_TYPE_IQ3_XXS:
+        case GGML_TYPE_IQ3_S:
+        case GGML_TYPE_IQ2_S:
+        case GGML_TYPE_IQ1_M:
+        case GGML_TYPE_TQ1_0:
+        case GGML_TYPE_TQ2_0:    return GGML_TYPE_IQ4_NL;
+        case GGML_TYPE_Q4_K:     return GGML_TYPE_Q5_0;
+        case GGML_TYPE_Q5_K:     return GGML_TYPE_Q5_1;
+        case GGML_TYPE_Q6_K:     return GGML_TYPE_Q8_0;
+        default:                 return GGML_TYPE_F16;
+    }
+}
+
+static int32_t whisper_quantize_ftype(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_F32:      return GGML_FTYPE_ALL_F32;
+        case GGML_TYPE_F16:      return GGML_FTYPE_MOSTLY_F16;
+        case GGML_TYPE_BF16:     return GGML_FTYPE_MOSTLY_BF16;
+        case GGML_TYPE_Q4_0:     return GGML_FTYPE_MOSTLY_Q4_0;
+        case GGML_TYPE_Q4_1:     return GGML_FTYPE_MOSTLY_Q4_1;
+        case GGML_TYPE_Q5_0:     return GGML_FTYPE_MOSTLY_Q5_0;
+        case GGML_TYPE_Q5_1:     return GGML_FTYPE_MOSTLY_Q5_1;
+        case GGML_TYPE_Q8_0:     return GGML_FTYPE_MOSTLY_Q8_0;
+        case GGML_TYPE_Q2_K:     return GGML_FTYPE_MOSTLY_Q2_K;
+        case GGML_TYPE_Q3_K:     return GGML_FTYPE_MOSTLY_Q3_K;
+        case GGML_TYPE_Q4_K:     return GGML_FTYPE_MOSTLY_Q4_K;
+        case GGML_TYPE_Q5_K:     return GGML_FTYPE_MOSTLY_Q5_K;
+        case GGML_TYPE_Q6_K:     return GGML_FTYPE_MOSTLY_Q6_K;
+        case GGML_TYPE_IQ4_NL:   return GGML_FTYPE_MOSTLY_IQ4_NL;
+        case GGML_TYPE_IQ4_XS:   return GGML_FTYPE_MOSTLY_IQ4_XS;
+        case GGML_TYPE_IQ3_XXS:  return GGML_FTYPE_MOSTLY_IQ3_XXS;
+        case GGML_TYPE_IQ3_S:    return GGML_FTYPE_MOSTLY_IQ3_S;
+        case GGML_TYPE_IQ2_S:    return GGML_FTYPE_MOSTLY_IQ2_S;
+        case GGML_TYPE_IQ1_M:    return GGML_FTYPE_MOSTLY_IQ1_M;
+        case GGML_TYPE_MXFP4:    return GGML_FTYPE_MOSTLY_MXFP4;
+        default:                 return GGML_FTYPE_UNKNOWN;
+    }
+}
+
+int whisper_model_quantize(const char * fname_inp, const char * fname_out, const struct whisper_model_quantize_params * params) {
+    WHISPER_LOG_INFO("%s: quantizing '%s' to '%s' (%s)\n", __func__, fname_inp, fname_out, ggml_type_name(params->type));
+
+    if (!whisper_quantize_type_supported(params->type)) {
+        WHISPER_LOG_ERROR("%s: unsupported type %s%s\n", __func__, ggml_type_name(params->type),
+                ggml_quantize_requires_imatrix(params->type) ? " (requires an importance matrix)" : "");
+        return 1;
     }
 
-    return ctx;
-}
-
-struct whisper_context * whisper_init_with_params(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_with_params_no_state(loader, params);
-    if (!ctx) {
-        return nullptr;
+    std::vector<std::regex> patterns;
+    for (int i = 0; i < params->n_patterns; ++i) {
+        if (!whisper_quantize_type_supported(params->types[i])) {
+            WHISPER_LOG_ERROR("%s: unsupported type %s for pattern '%s'%s\n", __func__, ggml_type_name(params->types[i]), params->patterns[i],
+                    ggml_quantize_requires_imatrix(params->types[i]) ? " (requires an importance matrix)" : "");
+            return 1;
+        }
+        try {
+            patterns.emplace_back(params->patterns[i]);
+        } catch (const std::regex_error & e) {
+            WHISPER_LOG_ERROR("%s: invalid pattern '%s': %s\n", __func__, params->patterns[i], e.what());
+            return 1;
+        }
     }
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+    whisper_model_file mf;
+    if (!whisper_model_file_read(mf, fname_inp)) {
+        return 2;
     }
 
-    return ctx;
-}
+    // only the weight matrices (2D tensors named *.weight) are quantized, the positional embeddings, the convolutions, the norms and the biases keep their type
+    std::vector<ggml_type> types;
+    for (const auto & info : mf.tensors) {
+        ggml_type type = info.type;
 
-struct whisper_context * whisper_init_from_file(const char * path_model) {
-    return whisper_init_from_file_with_params(path_model, whisper_context_default_params());
-}
+        const bool is_weight = info.name.size() > 7 && info.name.compare(info.name.size() - 7, 7, ".weight") == 0;
 
-struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
-    return whisper_init_from_buffer_with_params(buffer, buffer_size, whisper_context_default_params());
-}
+        if (info.n_dims == 2 && is_weight) {
+            type = params->type;
+            for (size_t i = 0; i < patterns.size(); ++i) {
+                if (std::regex_match(info.name, patterns[i])) {
+                    type = params->types[i];
+                    break;
+                }
+            }
 
-struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
-    return whisper_init_with_params(loader, whisper_context_default_params());
-}
+            while (info.ne[0] % ggml_blck_size(type) != 0) {
+                const ggml_type type_fallback = whisper_quantize_type_fallback(type);
+                WHISPER_LOG_WARN("%s: tensor '%s' with %d columns can not be quantized to %s, using %s\n", __func__,
+                        info.name.c_str(), (int) info.ne[0], ggml_type_name(type), ggml_type_name(type_fallback));
+                type = type_fallback;
+            }
+        }
 
-struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
-    return whisper_init_from_file_with_params_no_state(path_model, whisper_context_default_params());
-}
+        types.push_back(type);
+    }
 
-struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
-    return whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, whisper_context_default_params());
-}
+    // file type of the model: the type of the weight matrices which do not match a pattern
+    {
+        const int64_t id = gguf_find_key(mf.gguf.get(), "general.file_type");
+        const int32_t ftype_inp = id < 0 ? GGML_FTYPE_MOSTLY_F16 : gguf_get_val_i32(mf.gguf.get(), id);
+        const int32_t ftype_out = whisper_quantize_ftype(params->type);
 
-struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
-    return whisper_init_with_params_no_state(loader, whisper_context_default_params());
+        gguf_set_val_i32(mf.gguf.get(), "general.file_type", ftype_out == GGML_FTYPE_UNKNOWN ? ftype_inp : GGML_QNT_VERSION*GGML_QNT_VERSION_FACTOR + ftype_out);
+    }
+
+    if (!whisper_model_file_write_gguf(mf, fname_out, types, params->n_threads)) {
+        return 3;
+    }
+
+    return 0;
 }
 
 void whisper_free_state(struct whisper_state * state) {
@@ -3899,6 +6179,8 @@ int whisper_set_mel_with_state(
     state->mel.data.resize(n_len*n_mel);
     memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
 
+    state->mel.hash = whisper_mel_hash(state->mel);
+
     return 0;
 }
 
@@ -4248,6 +6530,10 @@ struct whisper_timings * whisper_get_timings(struct whisper_context * ctx) {
     timings->decode_ms = 1e-3f * ctx->state->t_decode_us / std::max(1, ctx->state->n_decode);
     timings->batchd_ms = 1e-3f * ctx->state->t_batchd_us / std::max(1, ctx->state->n_batchd);
     timings->prompt_ms = 1e-3f * ctx->state->t_prompt_us / std::max(1, ctx->state->n_prompt);
+    timings->n_encode        = ctx->state->n_encode;
+    timings->n_encode_cached = ctx->state->n_encode_cached;
+    timings->n_drafted  = ctx->state->n_drafted;
+    timings->n_accepted = ctx->state->n_accepted;
     return timings;
 }
 
@@ -4268,6 +6554,9 @@ void whisper_print_timings(struct whisper_context * ctx) {
         WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
         WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
         WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
+        if (ctx->state->n_encode_cached > 0) {
+            WHISPER_LOG_INFO("%s:  encode cache = %5d hits\n", __func__, ctx->state->n_encode_cached);
+        }
         WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
         WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
         WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
@@ -4275,6 +6564,154 @@ void whisper_print_timings(struct whisper_context * ctx) {
     WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
 
+// the kernel which computes node t
+//  - the device for nodes which are not computed on the CPU (e.g. CUDA0)
+//  - for matrix multiplications on the CPU: the buffer type of weights in a CPU extra buffer (e.g. CPU_REPACK, AMX)
+//  - else CPU, the CPU backend chooses itself between the llamafile sgemm kernels and its dot products
+static const char * whisper_profile_kernel(const ggml_tensor * t) {
+    if (t->buffer) {
+        ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(t->buffer));
+        if (dev && ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_CPU) {
+            return ggml_backend_dev_name(dev);
+        }
+    }
+
+    if (t->op == GGML_OP_MUL_MAT && t->src[0]->buffer && whisper_tensor_is_cpu_extra(t->src[0])) {
+        return ggml_backend_buffer_name(t->src[0]->buffer);
+    }
+
+    return "CPU";
+}
+
+static bool whisper_profile_eval_cb(struct ggml_tensor * t, bool ask, void * user_data) {
+    auto * cb = (whisper_profile::graph_cb *) user_data;
+    auto & profile = *cb->profile;
+
+    if (ask) {
+        // the nodes which are not computed are timed together with the next node
+        switch (t->op) {
+            case GGML_OP_NONE:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+                return false;
+            default:
+                break;
+        }
+
+        profile.t_start_us = ggml_time_us();
+
+        return true;
+    }
+
+    const int64_t t_us = ggml_time_us() - profile.t_start_us;
+
+    whisper_profile_op op = {
+        /*.graph   =*/ cb->graph,
+        /*.op      =*/ ggml_op_desc(t),
+        /*.kernel  =*/ whisper_profile_kernel(t),
+        /*.type    =*/ t->src[0] ? t->src[0]->type : t->type,
+        /*.ne      =*/ { t->ne[0], t->ne[1], t->ne[2] },
+        /*.n_calls =*/ 0,
+        /*.t_us    =*/ 0,
+    };
+
+    if (t->op == GGML_OP_MUL_MAT) {
+        op.ne[0] = t->src[0]->ne[1];
+        op.ne[1] = t->src[1]->ne[1];
+        op.ne[2] = t->src[0]->ne[0];
+    }
+
+    const std::string key = format("%s %s %s %s %" PRId64 " %" PRId64 " %" PRId64,
+            op.graph, op.op, op.kernel, ggml_type_name(op.type), op.ne[0], op.ne[1], op.ne[2]);
+
+    auto it = profile.index.find(key);
+    if (it == profile.index.end()) {
+        it = profile.index.emplace(key, profile.ops.size()).first;
+        profile.ops.push_back(op);
+    }
+
+    profile.ops[it->second].n_calls += 1;
+    profile.ops[it->second].t_us    += t_us;
+
+    return true;
+}
+
+void whisper_set_profile(struct whisper_context * ctx, bool enable) {
+    if (ctx->state == nullptr) {
+        return;
+    }
+
+    auto & state   = *ctx->state;
+    auto & profile = state.profile;
+
+    whisper_sched * scheds[4] = { &state.sched_conv, &state.sched_encode, &state.sched_cross, &state.sched_decode };
+    const char    * graphs[4] = { "conv", "encoder", "cross", "decoder" };
+
+    for (int i = 0; i < 4; ++i) {
+        profile.cbs[i] = { &profile, graphs[i] };
+
+        if (scheds[i]->sched) {
+            ggml_backend_sched_set_eval_callback(scheds[i]->sched, enable ? whisper_profile_eval_cb : nullptr, enable ? &profile.cbs[i] : nullptr);
+        }
+    }
+}
+
+int whisper_get_profile(struct whisper_context * ctx, const struct whisper_profile_op ** ops) {
+    if (ctx->state == nullptr) {
+        *ops = nullptr;
+        return 0;
+    }
+
+    *ops = ctx->state->profile.ops.data();
+
+    return (int) ctx->state->profile.ops.size();
+}
+
+void whisper_print_profile(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        return;
+    }
+
+    std::vector<whisper_profile_op> ops = ctx->state->profile.ops;
+    std::sort(ops.begin(), ops.end(), [](const whisper_profile_op & a, const whisper_profile_op & b) {
+        return a.t_us > b.t_us;
+    });
+
+    int64_t t_total_us = 0;
+    for (const auto & op : ops) {
+        t_total_us += op.t_us;
+    }
+
+    WHISPER_LOG_INFO("\n");
+    WHISPER_LOG_INFO("%s: %-8s %-16s %-12s %-8s %21s %7s %10s %10s %6s\n", __func__,
+            "graph", "op", "kernel", "type", "shape (m, n, k)", "calls", "total ms", "per call", "%");
+    for (const auto & op : ops) {
+        WHISPER_LOG_INFO("%s: %-8s %-16s %-12s %-8s %6" PRId64 " %6" PRId64 " %6" PRId64 " %7d %10.2f %10.3f %6.2f\n", __func__,
+                op.graph, op.op, op.kernel, ggml_type_name(op.type), op.ne[0], op.ne[1], op.ne[2], op.n_calls,
+                1e-3*op.t_us, 1e-3*op.t_us/op.n_calls, 100.0*op.t_us/std::max<int64_t>(1, t_total_us));
+    }
+    WHISPER_LOG_INFO("%s: total %.2f ms\n", __func__, 1e-3*t_total_us);
+}
+
+void whisper_reset_profile(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        return;
+    }
+
+    ctx->state->profile.ops.clear();
+    ctx->state->profile.index.clear();
+}
+
+size_t whisper_kv_self_nbytes(struct whisper_context * ctx) {
+    return ctx->state == nullptr ? 0 : whisper_kv_cache_nbytes(ctx->state->kv_self);
+}
+
+size_t whisper_kv_cross_nbytes(struct whisper_context * ctx) {
+    return ctx->state == nullptr ? 0 : whisper_kv_cache_nbytes(ctx->state->kv_cross);
+}
+
 void whisper_reset_timings(struct whisper_context * ctx) {
     ctx->t_start_us = ggml_time_us();
     if (ctx->state != nullptr) {
@@ -4286,9 +6723,12 @@ void whisper_reset_timings(struct whisper_context * ctx) {
         ctx->state->t_prompt_us = 0;
         ctx->state->n_sample = 0;
         ctx->state->n_encode = 0;
+        ctx->state->n_encode_cached = 0;
         ctx->state->n_decode = 0;
         ctx->state->n_batchd = 0;
         ctx->state->n_prompt = 0;
+        ctx->state->n_drafted  = 0;
+        ctx->state->n_accepted = 0;
     }
 }
 
@@ -5926,6 +8366,18 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.debug_mode        =*/ false,
         /*.audio_ctx         =*/ 0,
+        /*.audio_ctx_bucket  =*/ 64,
+        /*.audio_ctx_margin_ms =*/ 1000,
+
+        /*.draft_ctx         =*/ nullptr,
+        /*.n_draft           =*/ 8,
+
+        /*.lookup_ngram      =*/ 0,
+        /*.lookup_phrases    =*/ nullptr,
+        /*.n_lookup_phrases  =*/ 0,
+
+        /*.active_vocab      =*/ nullptr,
+        /*.n_active_vocab    =*/ 0,
 
         /*.tdrz_enable       =*/ false,
 
@@ -6095,46 +8547,310 @@ static const std::vector<std::string> non_speech_tokens = {
     "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
 };
 
-static void whisper_compute_logprobs(
-                const std::vector<float> & logits,
-                              const int    n_logits,
-                      std::vector<float> & logprobs) {
-    const float logit_max = *std::max_element(logits.begin(), logits.end());
-    float logsumexp = 0.0f;
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logsumexp += expf(logits[i] - logit_max);
+// log_softmax and softmax of the logits in 3 passes over the vocabulary: max, exp + sum and normalization
+//
+// the max and the sum of exp of the text tokens [0, n_text) and of the timestamp tokens [n_text, n_logits) are
+// kept separately, such that the timestamp rule of whisper_process_logits does not need extra passes
+//
+
+struct whisper_softmax_stats {
+    float max[2]; // max logit of the text tokens and of the timestamp tokens
+    float sum[2]; // sum of exp(logit - max_all) of the text tokens and of the timestamp tokens
+    float lse;    // log of the sum of exp of all the logits
+};
+
+// exp(x) for x <= 0, 0 for x <= -87 (including -INFINITY), see ggml_v_expf
+static WHISPER_VEC_INLINE float whisper_expf_neg(float x) {
+    const float z = x*1.44269502f + 12582912.0f;
+    const float n = z - 12582912.0f;
+    const float b = x - n*0.693145752f - n*1.42860677e-06f;
+
+    uint32_t e;
+    memcpy(&e, &z, sizeof(e));
+    e = (e << 23) + 0x3f800000;
+
+    float k;
+    memcpy(&k, &e, sizeof(k));
+
+    const float u = b*b;
+    const float j = ((0.00824739039f*b + 0.0418997668f)*u + (0.166683957f*b + 0.499991268f))*u + 0.999999404f*b;
+
+    return x > -87.0f ? k*j + k : 0.0f;
+}
+
+#if defined(WHISPER_VEC)
+// in place, the vectors are passed by reference as the AVX2 clones would change the ABI of vector arguments
+template <typename V, typename VI>
+static WHISPER_VEC_INLINE void whisper_vec_expf_neg(V & x) {
+    const V z = x*1.44269502f + 12582912.0f;
+    const V n = z - 12582912.0f;
+    const V b = x - n*0.693145752f - n*1.42860677e-06f;
+    const V k = (V) (((VI) z << 23) + 0x3f800000);
+    const V u = b*b;
+    const V j = ((0.00824739039f*b + 0.0418997668f)*u + (0.166683957f*b + 0.499991268f))*u + 0.999999404f*b;
+
+    x = (V) ((VI) (k*j + k) & (x > -87.0f));
+}
+
+// a = max(a, b)
+template <typename V, typename VI>
+static WHISPER_VEC_INLINE void whisper_vec_max(V & a, const V & b) {
+    const VI m = a > b;
+
+    a = (V) (((VI) a & m) | ((VI) b & ~m));
+}
+#endif
+
+template <typename V, typename VI>
+static WHISPER_VEC_INLINE float whisper_softmax_max(const float * x, int i0, int i1) {
+    float res = -INFINITY;
+
+    int i = i0;
+#if defined(WHISPER_VEC)
+    constexpr int nl = sizeof(V)/sizeof(float);
+    if (i1 - i0 >= nl) {
+        V acc;
+        memcpy(&acc, x + i, sizeof(V));
+        for (i += nl; i + nl <= i1; i += nl) {
+            V v;
+            memcpy(&v, x + i, sizeof(V));
+            whisper_vec_max<V, VI>(acc, v);
         }
+        for (int l = 0; l < nl; ++l) {
+            res = std::max(res, acc[l]);
+        }
+    }
+#endif
+    for (; i < i1; ++i) {
+        res = std::max(res, x[i]);
     }
-    logsumexp = logf(logsumexp) + logit_max;
 
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logprobs[i] = logits[i] - logsumexp;
-        } else {
-            logprobs[i] = -INFINITY;
-        }
+    return res;
+}
+
+// y = exp(x - max), returns the sum of y
+template <typename V, typename VI>
+static WHISPER_VEC_INLINE float whisper_softmax_exp(const float * x, float * y, int i0, int i1, float max) {
+    float res = 0.0f;
+
+    int i = i0;
+#if defined(WHISPER_VEC)
+    constexpr int nl = sizeof(V)/sizeof(float);
+    V acc = {};
+    for (; i + nl <= i1; i += nl) {
+        V v;
+        memcpy(&v, x + i, sizeof(V));
+        v -= max;
+        whisper_vec_expf_neg<V, VI>(v);
+        memcpy(y + i, &v, sizeof(V));
+        acc += v;
+    }
+    for (int l = 0; l < nl; ++l) {
+        res += acc[l];
+    }
+#endif
+    for (; i < i1; ++i) {
+        y[i] = whisper_expf_neg(x[i] - max);
+        res += y[i];
+    }
+
+    return res;
+}
+
+// logprobs = x - lse, probs *= scale
+template <typename V, typename VI>
+static WHISPER_VEC_INLINE void whisper_softmax_norm(const float * x, float * logprobs, float * probs, int n, float lse, float scale) {
+    int i = 0;
+#if defined(WHISPER_VEC)
+    constexpr int nl = sizeof(V)/sizeof(float);
+    for (; i + nl <= n; i += nl) {
+        V v;
+        V p;
+        memcpy(&v, x + i, sizeof(V));
+        memcpy(&p, probs + i, sizeof(V));
+        v -= lse;
+        p *= scale;
+        memcpy(logprobs + i, &v, sizeof(V));
+        memcpy(probs + i, &p, sizeof(V));
+    }
+#endif
+    for (; i < n; ++i) {
+        logprobs[i] = x[i] - lse;
+        probs[i]   *= scale;
+    }
+}
+
+template <typename V, typename VI>
+static WHISPER_VEC_INLINE void whisper_softmax_impl(
+        const float * logits, float * logprobs, float * probs, int n_logits, int n_text, whisper_softmax_stats & st) {
+    st.max[0] = whisper_softmax_max<V, VI>(logits, 0, n_text);
+    st.max[1] = whisper_softmax_max<V, VI>(logits, n_text, n_logits);
+
+    const float max_all = std::max(st.max[0], st.max[1]);
+    if (max_all == -INFINITY) {
+        // all the tokens are masked
+        std::fill(logprobs, logprobs + n_logits, -INFINITY);
+        std::fill(probs,    probs    + n_logits, 0.0f);
+
+        st.sum[0] = st.sum[1] = 0.0f;
+        st.lse    = -INFINITY;
+
+        return;
     }
+
+    st.sum[0] = whisper_softmax_exp<V, VI>(logits, probs, 0, n_text, max_all);
+    st.sum[1] = whisper_softmax_exp<V, VI>(logits, probs, n_text, n_logits, max_all);
+
+    const float sum = st.sum[0] + st.sum[1];
+
+    st.lse = logf(sum) + max_all;
+
+    whisper_softmax_norm<V, VI>(logits, logprobs, probs, n_logits, st.lse, 1.0f/sum);
+}
+
+static void whisper_softmax(
+        const float * logits, float * logprobs, float * probs, int n_logits, int n_text, whisper_softmax_stats & st) {
+    whisper_softmax_impl<whisper_v4f, whisper_v4i>(logits, logprobs, probs, n_logits, n_text, st);
 }
 
-static void whisper_compute_probs(
+#if defined(WHISPER_VEC_AVX2_CLONE)
+__attribute__((target("avx2,fma")))
+static void whisper_softmax_avx2(
+        const float * logits, float * logprobs, float * probs, int n_logits, int n_text, whisper_softmax_stats & st) {
+    whisper_softmax_impl<whisper_v8f, whisper_v8i>(logits, logprobs, probs, n_logits, n_text, st);
+}
+#endif
+
+// computes logprobs and probs of the logits [0, n_logits), see whisper_softmax_stats for n_text
+static whisper_softmax_stats whisper_compute_softmax(
     const std::vector<float> & logits,
                   const int    n_logits,
-    const std::vector<float> & logprobs,
-          std::vector<float> & probs)     {
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] == -INFINITY) {
-            probs[i] = 0.0f;
-        } else {
-            probs[i] = expf(logprobs[i]);
+                  const int    n_text,
+          std::vector<float> & logprobs,
+          std::vector<float> & probs) {
+    whisper_softmax_stats st;
+
+#if defined(WHISPER_VEC_AVX2_CLONE)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (has_avx2) {
+        whisper_softmax_avx2(logits.data(), logprobs.data(), probs.data(), n_logits, n_text, st);
+        return st;
+    }
+#endif
+
+    whisper_softmax(logits.data(), logprobs.data(), probs.data(), n_logits, n_text, st);
+
+    return st;
+}
+
+// look up the tokens suppressed by suppress_regex and suppress_nst in the vocabulary
+// the result is kept in the state, such that it is only recomputed when the regex changes
+static void whisper_suppress_init(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+    const struct whisper_full_params & params) {
+    const auto & vocab    = ctx.vocab;
+    auto       & suppress = state.suppress;
+
+    if (params.suppress_regex != nullptr && suppress.regex != params.suppress_regex) {
+        suppress.regex_ids.clear();
+
+        std::regex re(params.suppress_regex);
+        for (const auto & token_id : vocab.token_to_id) {
+            if (std::regex_match(token_id.first, re)) {
+                suppress.regex_ids.push_back(token_id.second);
+            }
+        }
+        std::sort(suppress.regex_ids.begin(), suppress.regex_ids.end());
+
+        suppress.regex = params.suppress_regex;
+    }
+
+    if (params.suppress_nst && !suppress.nst_init) {
+        auto add = [&](const std::string & token) {
+            const auto it = vocab.token_to_id.find(token);
+            if (it != vocab.token_to_id.end()) {
+                suppress.nst_ids.push_back(it->second);
+            }
+        };
+
+        for (const std::string & token : non_speech_tokens) {
+            add(token);
+            add(" " + token);
+        }
+
+        // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+        add(" -");
+        add(" '");
+
+        std::sort(suppress.nst_ids.begin(), suppress.nst_ids.end());
+        suppress.nst_ids.erase(std::unique(suppress.nst_ids.begin(), suppress.nst_ids.end()), suppress.nst_ids.end());
+
+        suppress.nst_init = true;
+    }
+}
+
+// allocate the buffers of a decoder when it is used for the first time (e.g. best_of decoders at the first temperature fallback)
+// greedy decoding which does not fall back only uses decoder 0, the buffers are kept in the state for the next windows / calls
+static void whisper_decoder_alloc(whisper_decoder & decoder, int n_vocab, int n_text_ctx) {
+    if ((int) decoder.probs.size() == n_vocab) {
+        return;
+    }
+
+    decoder.sequence.tokens.reserve(n_text_ctx);
+
+    decoder.probs.resize   (n_vocab);
+    decoder.logits.resize  (n_vocab);
+    decoder.logprobs.resize(n_vocab);
+}
+
+// the active vocabulary of params.active_vocab: the tokens of the words / phrases (with and without leading space),
+// the single byte tokens and all tokens from eot onwards (special + timestamp tokens)
+// left empty (full vocabulary) if it does not prune at least a quarter of the vocabulary
+static void whisper_vocab_active_init(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+    const struct whisper_full_params & params) {
+    const auto & vocab  = ctx.vocab;
+    auto       & active = state.vocab_active;
+
+    active.clear();
+    state.vocab_prune = false;
+
+    if (params.active_vocab == nullptr || params.n_active_vocab <= 0) {
+        return;
+    }
+
+    for (whisper_token id = 0; id < std::min(256, vocab.token_eot); ++id) {
+        active.push_back(id);
+    }
+    for (int i = 0; i < params.n_active_vocab; ++i) {
+        for (const std::string & text : { std::string(params.active_vocab[i]), " " + std::string(params.active_vocab[i]) }) {
+            for (const whisper_token id : ::tokenize(vocab, text)) {
+                if (id < vocab.token_eot) {
+                    active.push_back(id);
+                }
+            }
         }
     }
+    std::sort(active.begin(), active.end());
+    active.erase(std::unique(active.begin(), active.end()), active.end());
+
+    for (whisper_token id = vocab.token_eot; id < vocab.n_vocab; ++id) {
+        active.push_back(id);
+    }
+
+    if (4*active.size() > 3*(size_t) vocab.n_vocab) {
+        WHISPER_LOG_WARN("%s: the active vocabulary has %d of %d tokens - using the full vocabulary\n", __func__, (int) active.size(), vocab.n_vocab);
+        active.clear();
+    }
+
+    WHISPER_LOG_DEBUG("%s: active vocabulary of %d tokens\n", __func__, (int) active.size());
 }
 
 // process the logits for the selected decoder
 // - applies logit filters
 // - computes logprobs and probs
-// TODO: optimize
 static void whisper_process_logits(
               struct whisper_context & ctx,
                struct whisper_state  & state,
@@ -6156,12 +8872,14 @@ static void whisper_process_logits(
     auto & logprobs = decoder.logprobs;
     {
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
 
+        const float * logits_cur = state.logits.data() + decoder.i_batch*n_logits;
         if (temperature > 0.0f) {
             for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
+                logits[i] = logits_cur[i]/temperature;
             }
+        } else {
+            memcpy(logits.data(), logits_cur, n_logits*sizeof(float));
         }
 
         // will be populated a bit later
@@ -6219,32 +8937,16 @@ static void whisper_process_logits(
         // suppress any tokens matching a regular expression
         // ref: https://github.com/openai/whisper/discussions/1041
         if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
-                }
+            for (const whisper_token id : state.suppress.regex_ids) {
+                logits[id] = -INFINITY;
             }
         }
 
         // suppress non-speech tokens
         // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
         if (params.suppress_nst) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
-
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
+            for (const whisper_token id : state.suppress.nst_ids) {
+                logits[id] = -INFINITY;
             }
         }
 
@@ -6290,67 +8992,37 @@ static void whisper_process_logits(
             }
         }
 
-        // populate the logprobs array (log_softmax)
-        whisper_compute_logprobs(logits, n_logits, logprobs);
+        // populate the logprobs and probs arrays (log_softmax and softmax)
+        const whisper_softmax_stats st = whisper_compute_softmax(logits, n_logits, vocab.token_beg, logprobs, probs);
 
         // if sum of probability over timestamps is above any other token, sample timestamp
         // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
         {
-            // logsumexp over timestamps
+            // logsumexp over timestamps, from the sums of the softmax
             float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
+            if (st.sum[1] > 0.0f) {
+                timestamp_logprob = logf(st.sum[1]) + std::max(st.max[0], st.max[1]) - st.lse;
             }
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            const float max_text_token_logprob = st.max[0] - st.lse;
 
             //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
             if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
+                std::fill(logits.begin(),   logits.begin()   + vocab.token_beg, -INFINITY);
+                std::fill(logprobs.begin(), logprobs.begin() + vocab.token_beg, -INFINITY);
+                std::fill(probs.begin(),    probs.begin()    + vocab.token_beg, 0.0f);
             } else {
                 if (params.n_grammar_rules > 0) {
-                    whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
-
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
-
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
+                    whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
+
+                    // populate the logprobs and probs arrays again
+                    whisper_compute_softmax(logits, n_logits, vocab.token_beg, logprobs, probs);
                 }
             }
         }
     }
 
-    // compute probs
-    whisper_compute_probs(logits, n_logits, logprobs, probs);
-
 #if 0
     // print first 100 logits - token string : logit
     //for (int i = 0; i < 10; i++) {
@@ -6477,7 +9149,57 @@ static whisper_token_data whisper_sample_token(
     return result;
 }
 
-static std::vector<whisper_token_data> whisper_sample_token_topk(
+// the k tokens with the largest logits, in decreasing order of the logits (ties: smallest id first)
+// a min-heap of k (logit, id) pairs is kept in res, blocks of logits which are not larger than the
+// smallest logit in the heap are skipped with a vectorized max
+#define WHISPER_TOPK_BLOCK 64
+
+static void whisper_top_k(
+        const std::vector<float> & logits,
+                        const int   n_logits,
+                        const int   k,
+    std::vector<whisper_pair<double, whisper_vocab::id>> & res) {
+    using pair_type = whisper_pair<double, whisper_vocab::id>;
+
+    // a before b if a is larger: the heap keeps the smallest of the top k in front
+    const auto cmp = [](const pair_type & a, const pair_type & b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    };
+
+    res.clear();
+
+    const float * x = logits.data();
+
+    int i = 0;
+    for (; i < n_logits && (int) res.size() < k; ++i) {
+        res.emplace_back(x[i], i);
+        std::push_heap(res.begin(), res.end(), cmp);
+    }
+
+    while (i < n_logits) {
+        const int i1 = std::min(n_logits, i + WHISPER_TOPK_BLOCK);
+
+        float thold = res.front().first;
+        if (whisper_softmax_max<whisper_v4f, whisper_v4i>(x, i, i1) > thold) {
+            for (; i < i1; ++i) {
+                if (x[i] > thold) {
+                    std::pop_heap(res.begin(), res.end(), cmp);
+                    res.back() = pair_type(x[i], i);
+                    std::push_heap(res.begin(), res.end(), cmp);
+
+                    thold = res.front().first;
+                }
+            }
+        }
+
+        i = i1;
+    }
+
+    std::sort_heap(res.begin(), res.end(), cmp);
+}
+
+// samples k tokens among the top k candidates into decoder.tokens_topk
+static void whisper_sample_token_topk(
             whisper_context & ctx,
             whisper_decoder & decoder,
                         int   k) {
@@ -6489,26 +9211,13 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
 
     const int n_logits = vocab.n_vocab;
 
+    // the candidates: the top k tokens
     auto & logits_id = decoder.logits_id;
 
-    logits_id.resize(n_logits);
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id[i].first = logits[i];
-        logits_id[i].second = i;
-    }
-
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::partial_sort(
-                logits_id.begin(),
-                logits_id.begin() + k, logits_id.end(),
-                [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
+    whisper_top_k(logits, n_logits, k, logits_id);
 
-    std::vector<whisper_token_data> result;
-    result.reserve(k);
+    auto & result = decoder.tokens_topk;
+    result.clear();
 
     whisper_token tid = vocab.token_beg;
 
@@ -6535,10 +9244,26 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
         ptsum = sum_ts;
     }
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    // sample k times from the probabilities of the candidates
+    double sum = 0.0;
+    for (const auto & cand : logits_id) {
+        sum += probs[cand.second];
+    }
+
+    std::uniform_real_distribution<double> dist(0.0, sum);
 
     for (int i = 0; i < k; ++i) {
-        const auto id = dist(decoder.rng);
+        const double u = dist(decoder.rng);
+
+        // the first candidate with u < the cumulative probability, the largest candidate if all the probabilities are 0
+        int c = 0;
+        if (sum > 0.0) {
+            for (double cum = probs[logits_id[0].second]; cum <= u && c + 1 < (int) logits_id.size(); ) {
+                cum += probs[logits_id[++c].second];
+            }
+        }
+
+        const auto id = logits_id[c].second;
         //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
 
         result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, -1, 0.0f, });
@@ -6548,8 +9273,6 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
             result[i].pt  = result[i].p;
         }
     }
-
-    return result;
 }
 
 // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
@@ -6785,6 +9508,313 @@ static bool whisper_vad(
     return true;
 }
 
+// [EXPERIMENTAL] speculative decoding with a draft model or with prompt lookup
+//
+// the next tokens are proposed by looking up the last tokens in the text decoded so far, the text context and the
+// lookup phrases (prompt lookup), else the draft model proposes them greedily from its own encoder output
+// the current token and the draft tokens are then decoded by the model in a single batch. the logits of the batch
+// are used for the next steps as long as the sampled tokens are the draft tokens, the rejected draft tokens are
+// removed from the KV cache
+//
+
+struct whisper_spec {
+    whisper_context * dctx   = nullptr; // the draft model and its default state
+    whisper_state   * dstate = nullptr;
+
+    std::vector<whisper_token> dtokens; // tokens in the self-attention KV cache of the draft model
+    std::vector<whisper_token> tokens;  // work buffer: the prompt and the sampled tokens
+
+    int n_ngram = 0;                    // prompt lookup: number of tokens to match, 0 = disabled
+    std::vector<whisper_token> phrases; // the text tokens of the lookup phrases, each phrase preceded by -1
+    std::vector<whisper_token> lookup;  // the lookup phrases and the text tokens of the text context, separated by -1
+
+    std::vector<whisper_token> batch;   // the last verified batch: the current token and the draft tokens
+    int pos0   = 0;                     // position of batch[0]
+    int i_next = 0;                     // index in batch of the next token with computed logits
+
+    int n_drafted  = 0;
+    int n_accepted = 0;
+};
+
+static bool whisper_spec_init_draft(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    const whisper_full_params  & params,
+                   const float * samples,
+                           int   n_samples,
+                  whisper_spec & spec) {
+    whisper_context * dctx = params.draft_ctx;
+
+    if (dctx == ctx || dctx->state == nullptr || dctx->state == state) {
+        WHISPER_LOG_WARN("%s: the draft model needs its own default state - draft model disabled\n", __func__);
+        return false;
+    }
+
+    if (dctx->vocab.n_vocab != ctx->vocab.n_vocab) {
+        WHISPER_LOG_WARN("%s: the draft model has a different vocabulary (%d != %d tokens) - draft model disabled\n",
+                __func__, dctx->vocab.n_vocab, ctx->vocab.n_vocab);
+        return false;
+    }
+
+    if (dctx->model.hparams.n_audio_ctx != ctx->model.hparams.n_audio_ctx) {
+        WHISPER_LOG_WARN("%s: the draft model has a different audio context (%d != %d) - draft model disabled\n",
+                __func__, dctx->model.hparams.n_audio_ctx, ctx->model.hparams.n_audio_ctx);
+        return false;
+    }
+
+    if (n_samples > 0) {
+        if (whisper_pcm_to_mel_with_state(dctx, dctx->state, samples, n_samples, params.n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram of the draft model\n", __func__);
+            return false;
+        }
+    } else if (dctx->state->mel.n_len_org != state->mel.n_len_org) {
+        WHISPER_LOG_WARN("%s: the draft model has no mel spectrogram of the audio - draft model disabled\n", __func__);
+        return false;
+    }
+
+    spec.dctx   = dctx;
+    spec.dstate = dctx->state;
+
+    return true;
+}
+
+static bool whisper_spec_init(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    const whisper_full_params  & params,
+                   const float * samples,
+                           int   n_samples,
+                  whisper_spec & spec) {
+    if (params.n_draft <= 0) {
+        return false;
+    }
+
+    if (params.lookup_ngram > 0) {
+        spec.n_ngram = params.lookup_ngram;
+
+        // the phrases are tokenized as in the middle of a sentence
+        std::vector<whisper_token> tokens;
+        for (int i = 0; i < params.n_lookup_phrases; ++i) {
+            tokens = ::tokenize(ctx->vocab, std::string(" ") + params.lookup_phrases[i]);
+
+            spec.phrases.push_back(-1);
+            spec.phrases.insert(spec.phrases.end(), tokens.begin(), tokens.end());
+        }
+    }
+
+    if (params.draft_ctx != nullptr) {
+        whisper_spec_init_draft(ctx, state, params, samples, n_samples, spec);
+    }
+
+    return spec.n_ngram > 0 || spec.dctx != nullptr;
+}
+
+// the text to look up: the lookup phrases and the text tokens of the text context, without the timestamp tokens
+static void whisper_spec_lookup_init(
+                  whisper_spec & spec,
+         const whisper_vocab & vocab,
+    const std::vector<whisper_token> & prompt_past0,
+    const std::vector<whisper_token> & prompt_past1) {
+    auto & lookup = spec.lookup;
+
+    lookup = spec.phrases;
+
+    for (const auto * past : { &prompt_past0, &prompt_past1 }) {
+        lookup.push_back(-1);
+        for (const whisper_token id : *past) {
+            if (id < vocab.token_eot) {
+                lookup.push_back(id);
+            }
+        }
+    }
+}
+
+// appends up to n_draft tokens which followed the last occurrence of the last n_ngram text tokens of the sequence
+// to spec.batch, looking first in the sequence itself and then in the lookup text
+static void whisper_spec_lookup(
+                  whisper_spec & spec,
+         const whisper_vocab & vocab,
+        const whisper_sequence & sequence,
+                           int   n_draft) {
+    const int n     = spec.n_ngram;
+    const int n_seq = sequence.tokens.size();
+
+    if (n_seq < n) {
+        return;
+    }
+
+    const whisper_token_data * key = sequence.tokens.data() + n_seq - n;
+    for (int k = 0; k < n; ++k) {
+        if (key[k].id >= vocab.token_eot) {
+            return;
+        }
+    }
+
+    for (int i = n_seq - n - 1; i >= 0; --i) {
+        int k = 0;
+        while (k < n && sequence.tokens[i + k].id == key[k].id) {
+            ++k;
+        }
+        if (k == n) {
+            for (int j = i + n; j < n_seq && j < i + n + n_draft; ++j) {
+                spec.batch.push_back(sequence.tokens[j].id);
+            }
+            return;
+        }
+    }
+
+    const auto & lookup = spec.lookup;
+    const int n_lookup = lookup.size();
+
+    for (int i = n_lookup - n - 1; i >= 0; --i) {
+        int k = 0;
+        while (k < n && lookup[i + k] == key[k].id) {
+            ++k;
+        }
+        if (k == n) {
+            for (int j = i + n; j < n_lookup && j < i + n + n_draft && lookup[j] >= 0; ++j) {
+                spec.batch.push_back(lookup[j]);
+            }
+            return;
+        }
+    }
+}
+
+// the most likely text, timestamp or end of text token of the logits of the draft model
+static whisper_token whisper_spec_argmax(const whisper_vocab & vocab, const float * logits) {
+    whisper_token res = vocab.token_eot;
+
+    for (int i = 0; i < vocab.token_eot; ++i) {
+        if (logits[i] > logits[res]) {
+            res = i;
+        }
+    }
+    for (int i = vocab.token_beg; i < vocab.n_vocab; ++i) {
+        if (logits[i] > logits[res]) {
+            res = i;
+        }
+    }
+
+    return res;
+}
+
+// appends up to n_draft tokens proposed by the draft model after the prompt and the sampled tokens to spec.batch
+static bool whisper_spec_draft(
+                  whisper_spec & spec,
+    const std::vector<whisper_token> & prompt,
+        const whisper_sequence & sequence,
+                           int   n_draft,
+    const whisper_full_params  & params) {
+    auto & dctx    = *spec.dctx;
+    auto & dstate  = *spec.dstate;
+    auto & dtokens = spec.dtokens;
+    auto & tokens  = spec.tokens;
+
+    tokens.assign(prompt.begin(), prompt.end());
+    for (const auto & token : sequence.tokens) {
+        tokens.push_back(token.id);
+    }
+
+    // reuse the longest common prefix in the KV cache of the draft model, the last token is always decoded
+    int n_past = 0;
+    while (n_past < (int) dtokens.size() && n_past + 1 < (int) tokens.size() && dtokens[n_past] == tokens[n_past]) {
+        ++n_past;
+    }
+
+    whisper_kv_cache_seq_rm(dstate.kv_self, 0, n_past, -1);
+    dtokens.resize(n_past);
+
+    for (int k = 0; k < n_draft; ++k) {
+        whisper_batch_prep_legacy(dstate.batch, tokens.data() + n_past, tokens.size() - n_past, n_past, 0);
+
+        if (!whisper_decode_internal(dctx, dstate, dstate.batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+            return false;
+        }
+
+        dtokens.insert(dtokens.end(), tokens.begin() + n_past, tokens.end());
+        n_past = tokens.size();
+
+        const whisper_token id = whisper_spec_argmax(dctx.vocab, dstate.logits.data() + (dstate.batch.n_tokens - 1)*dctx.vocab.n_vocab);
+
+        spec.batch.push_back(id);
+        tokens.push_back(id);
+
+        if (id == dctx.vocab.token_eot) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+// computes the logits of the last sampled token of the decoder at position n_past
+// they are either in the logits of the last verified batch, or a new batch is drafted and verified
+static bool whisper_spec_decode(
+        struct whisper_context & ctx,
+          struct whisper_state & state,
+                  whisper_spec & spec,
+    const std::vector<whisper_token> & prompt,
+               whisper_decoder & decoder,
+                           int   n_past,
+    const whisper_full_params  & params) {
+    const whisper_token id = decoder.sequence.tokens.back().id;
+
+    const int r = n_past - spec.pos0;
+    if (r == spec.i_next && r < (int) spec.batch.size() && spec.batch[r] == id) {
+        decoder.i_batch = r;
+
+        spec.i_next++;
+        spec.n_accepted++;
+
+        return true;
+    }
+
+    // remove the rejected draft tokens
+    whisper_kv_cache_seq_rm(state.kv_self, 0, n_past, -1);
+
+    spec.batch.assign(1, id);
+
+    // the positions of the batch are limited by the text context of the model
+    const int n_draft = std::min(params.n_draft, ctx.model.hparams.n_text_ctx - 1 - n_past);
+    if (n_draft > 0 && spec.n_ngram > 0) {
+        whisper_spec_lookup(spec, ctx.vocab, decoder.sequence, n_draft);
+    }
+    if (n_draft > 0 && spec.dctx != nullptr && spec.batch.size() == 1) {
+        if (!whisper_spec_draft(spec, prompt, decoder.sequence, n_draft, params)) {
+            WHISPER_LOG_ERROR("%s: failed to decode with the draft model\n", __func__);
+            return false;
+        }
+    }
+
+    whisper_batch_prep_legacy(state.batch, spec.batch.data(), spec.batch.size(), n_past, 0);
+    for (int i = 0; i < state.batch.n_tokens; ++i) {
+        state.batch.logits[i] = 1;
+    }
+
+    if (!whisper_decode_internal(ctx, state, state.batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+        return false;
+    }
+
+    spec.pos0   = n_past;
+    spec.i_next = 1;
+
+    spec.n_drafted += spec.batch.size() - 1;
+
+    decoder.i_batch = 0;
+
+    return true;
+}
+
+// audio context size (encoder frames of 20 ms) to encode n_mel mel frames (10 ms) of audio plus a safety margin,
+// rounded up to a multiple of bucket and at most the audio context size of the model
+static int whisper_audio_ctx_auto(struct whisper_context * ctx, int n_mel, int bucket, int margin_ms) {
+    const int n_audio_ctx = whisper_n_audio_ctx(ctx);
+
+    const int n_ctx = (n_mel + 1)/2 + margin_ms/20;
+
+    return std::min(n_audio_ctx, bucket*((n_ctx + bucket - 1)/bucket));
+}
+
 int whisper_full_with_state(
         struct whisper_context * ctx,
           struct whisper_state * state,
@@ -6831,6 +9861,10 @@ int whisper_full_with_state(
         }
     }
 
+    // speculative decoding with a draft model
+    whisper_spec spec;
+    const bool use_spec = whisper_spec_init(ctx, state, params, samples, n_samples, spec);
+
     const int seek_start = params.offset_ms/10;
     const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
 
@@ -6877,17 +9911,9 @@ int whisper_full_with_state(
     }
 
     // TAGS: WHISPER_DECODER_INIT
+    // the buffers of the decoders are allocated the first time a temperature uses the decoder, see whisper_decoder_alloc
     for (int j = 1; j < n_decoders; j++) {
-        auto & decoder = state->decoders[j];
-
-        decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
-
-        decoder.probs.resize   (ctx->vocab.n_vocab);
-        decoder.logits.resize  (ctx->vocab.n_vocab);
-        decoder.logprobs.resize(ctx->vocab.n_vocab);
-        decoder.logits_id.reserve(ctx->model.hparams.n_vocab);
-
-        decoder.rng = std::mt19937(j);
+        state->decoders[j].rng = std::mt19937(j);
     }
 
     // the accumulated text context split into static (prompt_past0) and dynamic (prompt_past1)
@@ -6944,7 +9970,14 @@ int whisper_full_with_state(
         WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
         return -5;
     }
-    state->exp_n_audio_ctx = params.audio_ctx;
+    if (params.audio_ctx < -1 || (params.audio_ctx == -1 && (params.audio_ctx_bucket <= 0 || params.audio_ctx_margin_ms < 0))) {
+        WHISPER_LOG_ERROR("%s: invalid audio_ctx = %d (bucket = %d, margin = %d ms)\n", __func__, params.audio_ctx, params.audio_ctx_bucket, params.audio_ctx_margin_ms);
+        return -5;
+    }
+    state->exp_n_audio_ctx = std::max(0, params.audio_ctx);
+
+    whisper_suppress_init(*ctx, *state, params);
+    whisper_vocab_active_init(*ctx, *state, params);
 
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
@@ -6978,19 +10011,33 @@ int whisper_full_with_state(
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
+    // a beam search candidate: the sequence of decoder decoder_idx extended with token
+    // the sequence itself is only copied from its parent decoder when the candidate is selected
     struct beam_candidate {
         int decoder_idx;
         int seek_delta;
 
         bool has_ts;
 
-        whisper_sequence sequence;
-        whisper_grammar grammar;
+        whisper_token_data token;
+        double sum_logprobs_all; // of the extended sequence
     };
 
     std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
     std::vector<beam_candidate> beam_candidates;
 
+    // the sequences / grammars a decoder takes over from another decoder in a beam search step
+    std::vector<whisper_sequence> beam_sequences(n_decoders);
+    std::vector<whisper_grammar>  beam_grammars(n_decoders);
+
+    if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+        for (int j = 0; j < n_decoders; ++j) {
+            bc_per_dec[j].reserve(params.beam_search.beam_size);
+            beam_sequences[j].tokens.reserve(ctx->model.hparams.n_text_ctx);
+        }
+        beam_candidates.reserve(n_decoders*params.beam_search.beam_size);
+    }
+
     // main loop
     while (true) {
         if (params.progress_callback) {
@@ -7012,12 +10059,32 @@ int whisper_full_with_state(
             }
         }
 
+        // automatic audio context size: only encode the audio left in this window
+        if (params.audio_ctx == -1) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_auto(ctx, seek_end - seek, params.audio_ctx_bucket, params.audio_ctx_margin_ms);
+
+            WHISPER_LOG_DEBUG("%s: seek = %d, audio left = %d ms, audio_ctx = %d\n", __func__, seek, 10*(seek_end - seek), state->exp_n_audio_ctx);
+        }
+
         // encode audio features starting at offset seek
         if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
 
+        // encode the same audio with the draft model, its KV cache of the previous window is no longer valid
+        if (spec.dctx != nullptr) {
+            spec.dstate->exp_n_audio_ctx = state->exp_n_audio_ctx;
+
+            if (!whisper_encode_internal(*spec.dctx, *spec.dstate, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+                WHISPER_LOG_ERROR("%s: failed to encode with the draft model\n", __func__);
+                return -6;
+            }
+
+            whisper_kv_cache_clear(spec.dstate->kv_self);
+            spec.dtokens.clear();
+        }
+
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
         // to confuse the decoder and often make it repeat or hallucinate stuff
         if (seek > seek_start && seek + 500 >= seek_end) {
@@ -7027,6 +10094,13 @@ int whisper_full_with_state(
 
         int best_decoder_id = 0;
 
+        // prompt tokens currently stored in the self-attention KV cache of decoder 0 for this window
+        // the cached values depend on the encoder output, so they can only be reused until the next encode
+        std::vector<whisper_token> prompt_kv;
+
+        // sample with the active vocabulary, until the window fails with it
+        bool vocab_prune = !state->vocab_active.empty();
+
         for (int it = 0; it < (int) temperatures.size(); ++it) {
             const float t_cur = temperatures[it];
 
@@ -7057,6 +10131,8 @@ int whisper_full_with_state(
             for (int j = 0; j < n_decoders_cur; ++j) {
                 auto & decoder = state->decoders[j];
 
+                whisper_decoder_alloc(decoder, ctx->vocab.n_vocab, ctx->model.hparams.n_text_ctx);
+
                 decoder.sequence.tokens.clear();
                 decoder.sequence.result_len       = 0;
                 decoder.sequence.sum_logprobs_all = 0.0;
@@ -7079,7 +10155,6 @@ int whisper_full_with_state(
             }
 
             // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
             {
                 prompt.clear();
 
@@ -7120,24 +10195,54 @@ int whisper_full_with_state(
 
                     whisper_kv_cache_free(state->kv_self);
 
-                    // overallocate to workaround KV cache fragmentation issues
-                    const int factor = n_decoders_cur > 1 ? n_decoders_cur + 2 : 1;
+                    // the prompt is shared by all decoders and takes at most n_text_ctx/2 + a few special tokens,
+                    // each decoder generates at most n_text_ctx/2 tokens on top of it
+                    // fragmentation is handled by compacting the cache in whisper_decode_internal
+                    const int n_text_ctx = ctx->model.hparams.n_text_ctx;
+                    const int n_kv_self  = GGML_PAD(n_text_ctx + (n_decoders_cur - 1)*(n_text_ctx/2), 256);
 
-                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->params.type_kv,
                                 ctx->model.hparams.n_text_state,
                                 ctx->model.hparams.n_text_layer,
-                                GGML_PAD(ctx->model.hparams.n_text_ctx, 256)*factor)) {
+                                n_kv_self)) {
                         WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
                         whisper_free_state(state);
                         return -7;
                     }
 
+                    WHISPER_LOG_DEBUG("%s: kv self size = %7.2f MB (%d cells)\n", __func__,
+                            (ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v))/1e6, n_kv_self);
+
                     state->kv_self_n_dec = n_decoders_cur;
+
+                    // the cached decoder graph refers to the freed cache
+                    state->gf_decode.gf = nullptr;
+
+                    prompt_kv.clear();
+                }
+
+                // reuse the longest common prefix of the previous prompt (e.g. on temperature fallback)
+                // the last prompt token is always decoded, since we need its logits
+                int n_past = 0;
+                while (n_past < (int) prompt_kv.size() && n_past + 1 < (int) prompt.size() && prompt_kv[n_past] == prompt[n_past]) {
+                    ++n_past;
+                }
+
+                if (n_past > 0) {
+                    WHISPER_LOG_DEBUG("%s: reusing %d of %d prompt tokens from the KV cache\n", __func__, n_past, (int) prompt.size());
+
+                    whisper_kv_cache_seq_keep(state->kv_self, 0);
+                    whisper_kv_cache_seq_rm  (state->kv_self, 0, n_past, -1);
+                } else {
+                    whisper_kv_cache_clear(state->kv_self);
                 }
 
-                whisper_kv_cache_clear(state->kv_self);
+                whisper_batch_prep_legacy(state->batch, prompt.data() + n_past, prompt.size() - n_past, n_past, 0);
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+                prompt_kv = prompt;
+
+                // the prompt is decoded with the full vocabulary, such that no_speech_prob and the first token are exact
+                state->vocab_prune = false;
 
                 if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
                     WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
@@ -7151,15 +10256,16 @@ int whisper_full_with_state(
                     std::vector<float> logprobs(n_logits);
                     std::vector<float> probs(n_logits);
 
-                    whisper_compute_logprobs(state->logits, n_logits, logprobs);
-                    whisper_compute_probs(state->logits, n_logits, logprobs, probs);
+                    whisper_compute_softmax(state->logits, n_logits, n_logits, logprobs, probs);
                     state->no_speech_prob = probs[whisper_token_nosp(ctx)];
                 }
 
+                state->vocab_prune = vocab_prune;
+
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
+                    state->decoders[0].i_batch = prompt.size() - n_past - 1;
 
                     whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
@@ -7177,6 +10283,14 @@ int whisper_full_with_state(
                 }
             }
 
+            // speculative decoding is used with a single decoder, the logits of the prompt are not part of a verified batch
+            const bool spec_cur = use_spec && n_decoders_cur == 1;
+
+            spec.batch.clear();
+            if (spec_cur && spec.n_ngram > 0) {
+                whisper_spec_lookup_init(spec, ctx->vocab, prompt_past0, prompt_past1);
+            }
+
             for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
                 const int64_t t_start_sample_us = ggml_time_us();
 
@@ -7187,7 +10301,7 @@ int whisper_full_with_state(
                 }
 
                 // sampling
-                // TODO: avoid memory allocations, optimize, avoid threads?
+                // TODO: avoid threads?
                 {
                     std::atomic<int> j_cur(0);
 
@@ -7218,12 +10332,10 @@ int whisper_full_with_state(
                                     } break;
                                 case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
                                     {
-                                        const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
+                                        whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
 
-                                        for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
+                                        for (const auto & token : decoder.tokens_topk) {
+                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, token, decoder.sequence.sum_logprobs_all + token.plog, });
                                         }
                                     } break;
                             };
@@ -7264,16 +10376,29 @@ int whisper_full_with_state(
                             beam_candidates.begin(),
                             beam_candidates.end(),
                             [](const beam_candidate & a, const beam_candidate & b) {
-                        if (a.sequence.sum_logprobs_all != b.sequence.sum_logprobs_all) {
-                            return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                        if (a.sum_logprobs_all != b.sum_logprobs_all) {
+                            return a.sum_logprobs_all > b.sum_logprobs_all;
                         }
                         return a.decoder_idx < b.decoder_idx;
                     });
 
+                    // two candidates extend the same sequence with the same token
+                    auto candidates_equal = [&](const beam_candidate & a, const beam_candidate & b) {
+                        return a.token.id == b.token.id && (a.decoder_idx == b.decoder_idx ||
+                            whisper_sequence_tokens_equal(state->decoders[a.decoder_idx].sequence, state->decoders[b.decoder_idx].sequence));
+                    };
+
                     uint32_t cur_c = 0;
 
+                    // the candidate selected by each decoder, and the source sequence of each decoder's KV cells after this step
+                    int            bc_sel[WHISPER_MAX_DECODERS];
+                    whisper_seq_id kv_src[WHISPER_MAX_DECODERS];
+
                     for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                        const auto & decoder = state->decoders[j];
+
+                        bc_sel[j] = -1;
+                        kv_src[j] = -1;
 
                         if (decoder.completed || decoder.failed) {
                             continue;
@@ -7283,34 +10408,48 @@ int whisper_full_with_state(
                             cur_c = 0;
                         }
 
-                        auto & cur = beam_candidates[cur_c++];
+                        bc_sel[j] = cur_c++;
 
-                        while (beam_candidates.size() > cur_c && whisper_sequence_tokens_equal(beam_candidates[cur_c].sequence, cur.sequence) && i > 0) {
+                        while (beam_candidates.size() > cur_c && candidates_equal(beam_candidates[cur_c], beam_candidates[bc_sel[j]]) && i > 0) {
                             ++cur_c;
                         }
 
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
-                        decoder.sequence   = cur.sequence;
-                        decoder.grammar    = cur.grammar;
-
-                        whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
+                        kv_src[j] = beam_candidates[bc_sel[j]].decoder_idx;
+                    }
 
-                        WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                    // copy the sequences taken over from another decoder before any decoder is updated
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        if (kv_src[j] >= 0 && kv_src[j] != j) {
+                            beam_sequences[j] = state->decoders[kv_src[j]].sequence;
+                            beam_grammars[j]  = state->decoders[kv_src[j]].grammar;
+                        }
                     }
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
+                        if (bc_sel[j] < 0) {
+                            continue;
+                        }
+
                         auto & decoder = state->decoders[j];
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
+                        const auto & cur = beam_candidates[bc_sel[j]];
+
+                        if (cur.decoder_idx != j) {
+                            std::swap(decoder.sequence, beam_sequences[j]);
+                            std::swap(decoder.grammar,  beam_grammars[j]);
                         }
 
-                        whisper_kv_cache_seq_rm(state->kv_self, j,                           -1, -1);
-                        whisper_kv_cache_seq_cp(state->kv_self, WHISPER_MAX_DECODERS + j, j, -1, -1);
-                        whisper_kv_cache_seq_rm(state->kv_self, WHISPER_MAX_DECODERS + j,    -1, -1);
+                        decoder.seek_delta = cur.seek_delta;
+                        decoder.has_ts     = cur.has_ts;
+
+                        decoder.sequence.tokens.push_back(cur.token);
+                        decoder.sequence.sum_logprobs_all = cur.sum_logprobs_all;
+
+                        WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
+                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
                     }
+
+                    whisper_kv_cache_seq_remap(state->kv_self, kv_src, n_decoders_cur);
                 }
 
                 // update the decoder state
@@ -7424,36 +10563,43 @@ int whisper_full_with_state(
 
                 // obtain logits for the next token
                 {
-                    auto & batch = state->batch;
+                    const int n_past = prompt.size() + i;
 
-                    batch.n_tokens = 0;
+                    if (spec_cur) {
+                        if (!whisper_spec_decode(*ctx, *state, spec, prompt, state->decoders[0], n_past, params)) {
+                            WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                            return -9;
+                        }
+                    } else {
+                        auto & batch = state->batch;
 
-                    const int n_past = prompt.size() + i;
+                        batch.n_tokens = 0;
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                        for (int j = 0; j < n_decoders_cur; ++j) {
+                            auto & decoder = state->decoders[j];
 
-                        if (decoder.failed || decoder.completed) {
-                            continue;
-                        }
+                            if (decoder.failed || decoder.completed) {
+                                continue;
+                            }
 
-                        //WHISPER_LOG_DEBUG("%s: decoder %d: token %d, seek_delta %d\n", __func__, j, decoder.sequence.tokens.back().id, decoder.seek_delta);
+                            //WHISPER_LOG_DEBUG("%s: decoder %d: token %d, seek_delta %d\n", __func__, j, decoder.sequence.tokens.back().id, decoder.seek_delta);
 
-                        decoder.i_batch = batch.n_tokens;
+                            decoder.i_batch = batch.n_tokens;
 
-                        batch.token   [batch.n_tokens]    = decoder.sequence.tokens.back().id;
-                        batch.pos     [batch.n_tokens]    = n_past;
-                        batch.n_seq_id[batch.n_tokens]    = 1;
-                        batch.seq_id  [batch.n_tokens][0] = j;
-                        batch.logits  [batch.n_tokens]    = 1;
-                        batch.n_tokens++;
-                    }
+                            batch.token   [batch.n_tokens]    = decoder.sequence.tokens.back().id;
+                            batch.pos     [batch.n_tokens]    = n_past;
+                            batch.n_seq_id[batch.n_tokens]    = 1;
+                            batch.seq_id  [batch.n_tokens][0] = j;
+                            batch.logits  [batch.n_tokens]    = 1;
+                            batch.n_tokens++;
+                        }
 
-                    assert(batch.n_tokens > 0);
+                        assert(batch.n_tokens > 0);
 
-                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
-                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                        return -9;
+                        if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                            WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                            return -9;
+                        }
                     }
 
                     const int64_t t_start_sample_us = ggml_time_us();
@@ -7544,7 +10690,8 @@ int whisper_full_with_state(
             // was the decoding successful for the current temperature?
             // do fallback only if:
             // - we are not at the last temperature
-            if (it != (int) temperatures.size() - 1) {
+            // - or we sampled with the active vocabulary
+            if (it != (int) temperatures.size() - 1 || vocab_prune) {
                 const auto & decoder = state->decoders[best_decoder_id];
 
                 if (decoder.failed ||
@@ -7563,9 +10710,19 @@ int whisper_full_with_state(
                 break;
             }
 
+            if (vocab_prune) {
+                WHISPER_LOG_DEBUG("\n%s: failed to decode with the active vocabulary, decoding again with the full vocabulary\n", __func__);
+
+                vocab_prune = false;
+                --it;
+                continue;
+            }
+
             WHISPER_LOG_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
         }
 
+        state->vocab_prune = false;
+
         // output results through a user-provided callback
         {
             const auto & best_decoder = state->decoders[best_decoder_id];
@@ -7733,6 +10890,13 @@ int whisper_full_with_state(
         }
     }
 
+    if (use_spec) {
+        WHISPER_LOG_DEBUG("%s: speculative decoding: %d of %d draft tokens accepted\n", __func__, spec.n_accepted, spec.n_drafted);
+
+        state->n_drafted  += spec.n_drafted;
+        state->n_accepted += spec.n_accepted;
+    }
+
     return 0;
 }
 
@@ -7770,6 +10934,12 @@ int whisper_full_parallel(
         return whisper_full(ctx, params, samples, n_samples);
     }
 
+    // the draft model has a single state, which can not be shared by the processors
+    if (params.draft_ctx != nullptr) {
+        WHISPER_LOG_WARN("%s: speculative decoding is not used with multiple processors\n", __func__);
+        params.draft_ctx = nullptr;
+    }
+
     std::vector<float> vad_samples;
     if (params.vad) {
         WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
@@ -7865,10 +11035,14 @@ int whisper_full_parallel(
 
         ctx->state->n_sample += states[i]->n_sample;
         ctx->state->n_encode += states[i]->n_encode;
+        ctx->state->n_encode_cached += states[i]->n_encode_cached;
         ctx->state->n_decode += states[i]->n_decode;
         ctx->state->n_batchd += states[i]->n_batchd;
         ctx->state->n_prompt += states[i]->n_prompt;
 
+        ctx->state->n_drafted  += states[i]->n_drafted;
+        ctx->state->n_accepted += states[i]->n_accepted;
+
         whisper_free_state(states[i]);
     }
 
@@ -41,8 +41,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // whisper_load_model
-SEXP whisper_load_model(std::string model, bool use_gpu, bool flash_attn, int gpu_device, bool trace);
-RcppExport SEXP _audio_whisper_whisper_load_model(SEXP modelSEXP, SEXP use_gpuSEXP, SEXP flash_attnSEXP, SEXP gpu_deviceSEXP, SEXP traceSEXP) {
+SEXP whisper_load_model(std::string model, bool use_gpu, bool flash_attn, int gpu_device, bool trace, std::string kv_type, int encoder_cache, bool use_mmap, int n_threads_load, bool repack);
+RcppExport SEXP _audio_whisper_whisper_load_model(SEXP modelSEXP, SEXP use_gpuSEXP, SEXP flash_attnSEXP, SEXP gpu_deviceSEXP, SEXP traceSEXP, SEXP kv_typeSEXP, SEXP encoder_cacheSEXP, SEXP use_mmapSEXP, SEXP n_threads_loadSEXP, SEXP repackSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -51,13 +51,18 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< bool >::type flash_attn(flash_attnSEXP);
     Rcpp::traits::input_parameter< int >::type gpu_device(gpu_deviceSEXP);
     Rcpp::traits::input_parameter< bool >::type trace(traceSEXP);
-    rcpp_result_gen = Rcpp::wrap(whisper_load_model(model, use_gpu, flash_attn, gpu_device, trace));
+    Rcpp::traits::input_parameter< std::string >::type kv_type(kv_typeSEXP);
+    Rcpp::traits::input_parameter< int >::type encoder_cache(encoder_cacheSEXP);
+    Rcpp::traits::input_parameter< bool >::type use_mmap(use_mmapSEXP);
+    Rcpp::traits::input_parameter< int >::type n_threads_load(n_threads_loadSEXP);
+    Rcpp::traits::input_parameter< bool >::type repack(repackSEXP);
+    rcpp_result_gen = Rcpp::wrap(whisper_load_model(model, use_gpu, flash_attn, gpu_device, trace, kv_type, encoder_cache, use_mmap, n_threads_load, repack));
     return rcpp_result_gen;
 END_RCPP
 }
 // whisper_encode
-Rcpp::List whisper_encode(SEXP model, std::string path, std::string language, bool token_timestamps, bool translate, Rcpp::IntegerVector duration, Rcpp::IntegerVector offset, int trace, int n_threads, int n_processors, float entropy_thold, float logprob_thold, int beam_size, int best_of, bool split_on_word, int max_context, std::string prompt, bool print_special, bool diarize, float diarize_percent, bool no_timestamps, bool vad, std::string vad_model, float vad_threshold, int vad_min_speech_duration_ms, int vad_min_silence_duration_ms);
-RcppExport SEXP _audio_whisper_whisper_encode(SEXP modelSEXP, SEXP pathSEXP, SEXP languageSEXP, SEXP token_timestampsSEXP, SEXP translateSEXP, SEXP durationSEXP, SEXP offsetSEXP, SEXP traceSEXP, SEXP n_threadsSEXP, SEXP n_processorsSEXP, SEXP entropy_tholdSEXP, SEXP logprob_tholdSEXP, SEXP beam_sizeSEXP, SEXP best_ofSEXP, SEXP split_on_wordSEXP, SEXP max_contextSEXP, SEXP promptSEXP, SEXP print_specialSEXP, SEXP diarizeSEXP, SEXP diarize_percentSEXP, SEXP no_timestampsSEXP, SEXP vadSEXP, SEXP vad_modelSEXP, SEXP vad_thresholdSEXP, SEXP vad_min_speech_duration_msSEXP, SEXP vad_min_silence_duration_msSEXP) {
+Rcpp::List whisper_encode(SEXP model, std::string path, std::string language, bool token_timestamps, bool translate, Rcpp::IntegerVector duration, Rcpp::IntegerVector offset, int trace, int n_threads, int n_processors, float entropy_thold, float logprob_thold, int beam_size, int best_of, bool split_on_word, int max_context, std::string prompt, bool print_special, bool diarize, float diarize_percent, bool no_timestamps, bool vad, std::string vad_model, float vad_threshold, int vad_min_speech_duration_ms, int vad_min_silence_duration_ms, int audio_ctx, SEXP draft, int n_draft, int lookup_ngram, std::vector<std::string> lookup_phrases, std::vector<std::string> vocabulary);
+RcppExport SEXP _audio_whisper_whisper_encode(SEXP modelSEXP, SEXP pathSEXP, SEXP languageSEXP, SEXP token_timestampsSEXP, SEXP translateSEXP, SEXP durationSEXP, SEXP offsetSEXP, SEXP traceSEXP, SEXP n_threadsSEXP, SEXP n_processorsSEXP, SEXP entropy_tholdSEXP, SEXP logprob_tholdSEXP, SEXP beam_sizeSEXP, SEXP best_ofSEXP, SEXP split_on_wordSEXP, SEXP max_contextSEXP, SEXP promptSEXP, SEXP print_specialSEXP, SEXP diarizeSEXP, SEXP diarize_percentSEXP, SEXP no_timestampsSEXP, SEXP vadSEXP, SEXP vad_modelSEXP, SEXP vad_thresholdSEXP, SEXP vad_min_speech_duration_msSEXP, SEXP vad_min_silence_duration_msSEXP, SEXP audio_ctxSEXP, SEXP draftSEXP, SEXP n_draftSEXP, SEXP lookup_ngramSEXP, SEXP lookup_phrasesSEXP, SEXP vocabularySEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -87,18 +92,52 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< float >::type vad_threshold(vad_thresholdSEXP);
     Rcpp::traits::input_parameter< int >::type vad_min_speech_duration_ms(vad_min_speech_duration_msSEXP);
     Rcpp::traits::input_parameter< int >::type vad_min_silence_duration_ms(vad_min_silence_duration_msSEXP);
-    rcpp_result_gen = Rcpp::wrap(whisper_encode(model, path, language, token_timestamps, translate, duration, offset, trace, n_threads, n_processors, entropy_thold, logprob_thold, beam_size, best_of, split_on_word, max_context, prompt, print_special, diarize, diarize_percent, no_timestamps, vad, vad_model, vad_threshold, vad_min_speech_duration_ms, vad_min_silence_duration_ms));
+    Rcpp::traits::input_parameter< int >::type audio_ctx(audio_ctxSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type draft(draftSEXP);
+    Rcpp::traits::input_parameter< int >::type n_draft(n_draftSEXP);
+    Rcpp::traits::input_parameter< int >::type lookup_ngram(lookup_ngramSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type lookup_phrases(lookup_phrasesSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type vocabulary(vocabularySEXP);
+    rcpp_result_gen = Rcpp::wrap(whisper_encode(model, path, language, token_timestamps, translate, duration, offset, trace, n_threads, n_processors, entropy_thold, logprob_thold, beam_size, best_of, split_on_word, max_context, prompt, print_special, diarize, diarize_percent, no_timestamps, vad, vad_model, vad_threshold, vad_min_speech_duration_ms, vad_min_silence_duration_ms, audio_ctx, draft, n_draft, lookup_ngram, lookup_phrases, vocabulary));
     return rcpp_result_gen;
 END_RCPP
 }
 // whisper_print_benchmark
-void whisper_print_benchmark(SEXP model, int n_threads);
-RcppExport SEXP _audio_whisper_whisper_print_benchmark(SEXP modelSEXP, SEXP n_threadsSEXP) {
+Rcpp::List whisper_print_benchmark(SEXP model, int n_threads, bool profile);
+RcppExport SEXP _audio_whisper_whisper_print_benchmark(SEXP modelSEXP, SEXP n_threadsSEXP, SEXP profileSEXP) {
 BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< SEXP >::type model(modelSEXP);
     Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
-    whisper_print_benchmark(model, n_threads);
+    Rcpp::traits::input_parameter< bool >::type profile(profileSEXP);
+    rcpp_result_gen = Rcpp::wrap(whisper_print_benchmark(model, n_threads, profile));
+    return rcpp_result_gen;
+END_RCPP
+}
+// whisper_model_convert
+void whisper_model_convert(std::string path, std::string file);
+RcppExport SEXP _audio_whisper_whisper_model_convert(SEXP pathSEXP, SEXP fileSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    whisper_model_convert(path, file);
+    return R_NilValue;
+END_RCPP
+}
+// whisper_model_quantize_recipe
+void whisper_model_quantize_recipe(std::string path, std::string file, std::string type, Rcpp::CharacterVector patterns, Rcpp::CharacterVector types, int n_threads);
+RcppExport SEXP _audio_whisper_whisper_model_quantize_recipe(SEXP pathSEXP, SEXP fileSEXP, SEXP typeSEXP, SEXP patternsSEXP, SEXP typesSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    Rcpp::traits::input_parameter< std::string >::type type(typeSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type patterns(patternsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type types(typesSEXP);
+    Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
+    whisper_model_quantize_recipe(path, file, type, patterns, types, n_threads);
     return R_NilValue;
 END_RCPP
 }
@@ -136,9 +175,11 @@ END_RCPP
 static const R_CallMethodDef CallEntries[] = {
     {"_audio_whisper_silero_vad", (DL_FUNC) &_audio_whisper_silero_vad, 11},
     {"_audio_whisper_whisper_load_backend", (DL_FUNC) &_audio_whisper_whisper_load_backend, 0},
-    {"_audio_whisper_whisper_load_model", (DL_FUNC) &_audio_whisper_whisper_load_model, 5},
-    {"_audio_whisper_whisper_encode", (DL_FUNC) &_audio_whisper_whisper_encode, 26},
-    {"_audio_whisper_whisper_print_benchmark", (DL_FUNC) &_audio_whisper_whisper_print_benchmark, 2},
+    {"_audio_whisper_whisper_load_model", (DL_FUNC) &_audio_whisper_whisper_load_model, 10},
+    {"_audio_whisper_whisper_encode", (DL_FUNC) &_audio_whisper_whisper_encode, 32},
+    {"_audio_whisper_whisper_print_benchmark", (DL_FUNC) &_audio_whisper_whisper_print_benchmark, 3},
+    {"_audio_whisper_whisper_model_convert", (DL_FUNC) &_audio_whisper_whisper_model_convert, 2},
+    {"_audio_whisper_whisper_model_quantize_recipe", (DL_FUNC) &_audio_whisper_whisper_model_quantize_recipe, 6},
     {"_audio_whisper_whisper_language_info", (DL_FUNC) &_audio_whisper_whisper_language_info, 0},
     {"_audio_whisper_ggml_devices", (DL_FUNC) &_audio_whisper_ggml_devices, 0},
     {"_audio_whisper_ggml_unload", (DL_FUNC) &_audio_whisper_ggml_unload, 1},
@@ -118,6 +118,26 @@ extern "C" {
         bool  flash_attn;
         int   gpu_device;  // CUDA device
 
+        // [EXPERIMENTAL] type of the decoder self- and cross-attention KV cache
+        // GGML_TYPE_F16 (default), or GGML_TYPE_Q8_0, Q5_0, Q5_1, Q4_0, Q4_1 which require flash_attn
+        enum ggml_type type_kv;
+
+        // [EXPERIMENTAL] max size in bytes of the encoder outputs cached per state (0 = disabled)
+        // windows which were encoded before (same audio, offset and audio_ctx) then skip the encoder
+        size_t enc_cache_size;
+
+        // [EXPERIMENTAL] memory map the model file in whisper_init_from_file_with_params*()
+        // weights in CPU memory then use the data of the mapping directly (zero-copy), shared between processes
+        bool use_mmap;
+
+        // number of threads reading the tensor data in whisper_init_from_file_with_params*()
+        // 1 reads the model file sequentially
+        int n_threads_load;
+
+        // place the weights in the CPU extra buffer types when supported (default true)
+        // e.g. q4_0, q4_K and iq4_nl weights are repacked at load time in an interleaved layout for faster matrix multiplications
+        bool use_extra_bufts;
+
         // [EXPERIMENTAL] Token-level timestamps with DTW
         bool dtw_token_timestamps;
         enum whisper_alignment_heads_preset dtw_aheads_preset;
@@ -264,6 +284,36 @@ extern "C" {
                     const char * device,
                     const char * cache_dir);
 
+    // [EXPERIMENTAL] Convert a model file in the legacy ggml format to a GGUF model file
+    // The tensor data is aligned in the GGUF file, such that it can be memory mapped without copies (use_mmap)
+    // The tensors are written with the same type, the conversion needs memory for 1 tensor at a time
+    // Returns 0 on success
+    WHISPER_API int whisper_model_convert_gguf(const char * fname_inp, const char * fname_out);
+
+    // [EXPERIMENTAL] Quantize the weight matrices of a model file (legacy ggml format or GGUF) to a GGUF model file
+    // Mixed precision: the type of a weight matrix is the type of the first pattern (regular expression) matching the
+    // full name of the tensor (e.g. "encoder\\.blocks\\..*\\.attn\\..*"), or the default type if no pattern matches
+    // Types with a block size which does not divide the row length of a tensor fall back to a type which does (e.g. q4_K -> q5_0)
+    // Convolutions, norms, biases and positional embeddings keep their type
+    // The types which require an importance matrix (iq2_xxs, iq2_xs, iq1_s) are not supported
+    // The tensors are read, quantized with n_threads and written 1 at a time
+    // Returns 0 on success
+    struct whisper_model_quantize_params {
+        enum ggml_type type;      // default type of the weight matrices
+        int            n_threads; // number of threads to quantize a tensor
+
+        int                       n_patterns;
+        const char * const      * patterns;
+        const enum ggml_type    * types;
+    };
+
+    WHISPER_API struct whisper_model_quantize_params whisper_model_quantize_default_params(void);
+
+    WHISPER_API int whisper_model_quantize(
+                        const char * fname_inp,
+                        const char * fname_out,
+            const struct whisper_model_quantize_params * params);
+
     // Frees all allocated memory
     WHISPER_API void whisper_free      (struct whisper_context * ctx);
     WHISPER_API void whisper_free_state(struct whisper_state * state);
@@ -441,11 +491,44 @@ extern "C" {
         float decode_ms;
         float batchd_ms;
         float prompt_ms;
+
+        // number of encoder calls and of encoder calls which reused a previous encoder output
+        int32_t n_encode;
+        int32_t n_encode_cached;
+
+        // speculative decoding: number of draft tokens proposed / accepted by the main model
+        int32_t n_drafted;
+        int32_t n_accepted;
     };
     WHISPER_API struct whisper_timings * whisper_get_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_reset_timings(struct whisper_context * ctx);
 
+    // Size in bytes of the K and V tensors of the self-attention KV cache (of all decoders) and of the
+    // cross-attention KV cache of the default state. The self-attention cache grows when more decoders are used.
+    WHISPER_API size_t whisper_kv_self_nbytes (struct whisper_context * ctx);
+    WHISPER_API size_t whisper_kv_cross_nbytes(struct whisper_context * ctx);
+
+    // Per-op profile of the graphs computed by the default state.
+    // The nodes with the same graph, op, kernel, type and shape are aggregated.
+    // kernel: the device for nodes which are not computed on the CPU, else for matrix multiplications
+    //         the CPU extra buffer type of the weights (CPU_REPACK, AMX), else CPU
+    // ne:     (m, n, k) for matrix multiplications, else the shape of the result
+    // Profiling synchronizes the backend after each node and slows down the computation.
+    struct whisper_profile_op {
+        const char * graph; // conv, encoder, cross or decoder
+        const char * op;
+        const char * kernel;
+        enum ggml_type type; // type of the first source (the weights of a matrix multiplication)
+        int64_t ne[3];
+        int     n_calls;
+        int64_t t_us;
+    };
+    WHISPER_API void whisper_set_profile  (struct whisper_context * ctx, bool enable);
+    WHISPER_API int  whisper_get_profile  (struct whisper_context * ctx, const struct whisper_profile_op ** ops);
+    WHISPER_API void whisper_print_profile(struct whisper_context * ctx);
+    WHISPER_API void whisper_reset_profile(struct whisper_context * ctx);
+
     // Print system information
     WHISPER_API const char * whisper_print_system_info(void);
 
@@ -512,7 +595,31 @@ extern "C" {
         // [EXPERIMENTAL] speed-up techniques
         // note: these can significantly reduce the quality of the output
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
-        int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        int  audio_ctx;         // overwrite the audio context size (0 = use default, -1 = automatic)
+
+        // automatic audio context size (audio_ctx = -1): each window is encoded with the length of the audio left in the window
+        // plus a safety margin, rounded up to a multiple of audio_ctx_bucket encoder frames (20 ms each)
+        int  audio_ctx_bucket;    // (default 64)
+        int  audio_ctx_margin_ms; // (default 1000)
+
+        // [EXPERIMENTAL] speculative decoding: a smaller model with the same vocabulary (e.g. tiny for medium / large-v2)
+        // proposes up to n_draft tokens with its default state, which this model verifies in a single batched decode
+        // only used when decoding with a single decoder (greedy at temperature 0, best_of = 1 or beam_size = 1), the tokens are the ones of this model
+        struct whisper_context * draft_ctx; // (default nullptr = disabled)
+        int  n_draft;                       // (default 8)
+
+        // [EXPERIMENTAL] prompt lookup: propose the tokens which followed the last occurrence of the last lookup_ngram
+        // text tokens in the decoded text, the text context / initial prompt and the lookup phrases (e.g. product names,
+        // scripted sentences), before asking draft_ctx. Verified the same way as the tokens of the draft model
+        int  lookup_ngram;                  // (default 0 = disabled)
+        const char ** lookup_phrases;       // (default nullptr)
+        int  n_lookup_phrases;              // (default 0)
+
+        // [EXPERIMENTAL] active vocabulary: while sampling, the logits are only computed for the tokens of these words / phrases,
+        // the single byte tokens (such that any text can still be spelled) and the special and timestamp tokens
+        // a window which fails the logprob / entropy thresholds with the active vocabulary is decoded again with the full vocabulary
+        const char ** active_vocab;         // (default nullptr = full vocabulary)
+        int  n_active_vocab;                // (default 0)
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
@@ -213,12 +213,19 @@ void whisper_load_backend() {
 class WhisperModel {
     public: 
         struct whisper_context * ctx;
-        WhisperModel(std::string model, bool use_gpu = false, int gpu_device = 0, bool flash_attn = true){
+        WhisperModel(std::string model, bool use_gpu = false, int gpu_device = 0, bool flash_attn = true, ggml_type type_kv = GGML_TYPE_F16, size_t enc_cache_size = 0, bool use_mmap = false, int n_threads_load = 0, bool repack = true){
           
           struct whisper_context_params cparams = whisper_context_default_params();
           cparams.use_gpu = use_gpu;
           cparams.gpu_device = gpu_device;
           cparams.flash_attn = flash_attn;
+          cparams.type_kv = type_kv;
+          cparams.enc_cache_size = enc_cache_size;
+          cparams.use_mmap = use_mmap;
+          if(n_threads_load > 0){
+            cparams.n_threads_load = n_threads_load;
+          }
+          cparams.use_extra_bufts = repack;
           ctx = whisper_init_from_file_with_params(model.c_str(), cparams);
         }
         ~WhisperModel(){
@@ -226,15 +233,25 @@ class WhisperModel {
         }
 };
 
+ggml_type ggml_type_from_name(std::string name) {
+    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+        const char * type_name = ggml_type_name((ggml_type) i);
+        if (type_name != NULL && name == type_name) {
+            return (ggml_type) i;
+        }
+    }
+    Rcpp::stop("Unknown ggml type: " + name);
+}
+
 // [[Rcpp::export]]
-SEXP whisper_load_model(std::string model, bool use_gpu = false, bool flash_attn = true, int gpu_device = 0, bool trace = true) {
+SEXP whisper_load_model(std::string model, bool use_gpu = false, bool flash_attn = true, int gpu_device = 0, bool trace = true, std::string kv_type = "f16", int encoder_cache = 0, bool use_mmap = false, int n_threads_load = 0, bool repack = true) {
     // Load language model and return the pointer to be used by whisper_encode
     //struct whisper_context * ctx = whisper_init(model.c_str());
     //Rcpp::XPtr<whisper_context> ptr(ctx, false);
     if(trace > 0){
       Rprintf("system_info: hardware_concurrency = %d | %s\n", std::thread::hardware_concurrency(), whisper_print_system_info());  
     }
-    WhisperModel * wp = new WhisperModel(model, use_gpu, gpu_device, flash_attn);
+    WhisperModel * wp = new WhisperModel(model, use_gpu, gpu_device, flash_attn, ggml_type_from_name(kv_type), (size_t) std::max(0, encoder_cache) * 1024 * 1024, use_mmap, n_threads_load, repack);
     Rcpp::XPtr<WhisperModel> ptr(wp, false);
     return ptr;
 }
@@ -259,7 +276,13 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
                           std::string vad_model = "",
                           float vad_threshold = 0.5,
                           int vad_min_speech_duration_ms = 250,
-                          int vad_min_silence_duration_ms = 100) {
+                          int vad_min_silence_duration_ms = 100,
+                          int audio_ctx = 0,
+                          SEXP draft = R_NilValue,
+                          int n_draft = 8,
+                          int lookup_ngram = 0,
+                          std::vector<std::string> lookup_phrases = std::vector<std::string>(),
+                          std::vector<std::string> vocabulary = std::vector<std::string>()) {
   
     float audio_duration=0;
   
@@ -282,6 +305,7 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
     params.prompt = prompt;
     params.diarize = diarize;
     params.no_timestamps = no_timestamps;
+    params.audio_ctx = audio_ctx;
     if (params.fname_inp.empty()) {
         Rcpp::stop("error: no input files specified");
     }
@@ -300,6 +324,21 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
     struct whisper_context * ctx = whispermodel->ctx;
     //Rcpp::XPtr<whisper_context> ctx(model);
     //struct whisper_context * ctx = whisper_init(params.model.c_str());
+    
+    // draft model for speculative decoding
+    struct whisper_context * draft_ctx = nullptr;
+    if (!Rf_isNull(draft)) {
+      Rcpp::XPtr<WhisperModel> draftmodel(draft);
+      draft_ctx = draftmodel->ctx;
+    }
+    std::vector<const char *> lookup_phrases_c;
+    for (const auto & phrase : lookup_phrases) {
+      lookup_phrases_c.push_back(phrase.c_str());
+    }
+    std::vector<const char *> vocabulary_c;
+    for (const auto & word : vocabulary) {
+      vocabulary_c.push_back(word.c_str());
+    }
 
     const auto fname_inp = params.fname_inp[0];
     std::vector<float> pcmf32;               // mono-channel F32 PCM
@@ -347,6 +386,7 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
     //Rcpp::StringVector token_speaker(0);
     int n_segments;
     
+    whisper_reset_timings(ctx);
     for (int f = 0; f < (int) offset.size(); ++f) {
         // run the inference
         {
@@ -376,6 +416,13 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
             wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
             wparams.split_on_word    = params.split_on_word;
             wparams.audio_ctx        = params.audio_ctx;
+            wparams.draft_ctx        = draft_ctx;
+            wparams.n_draft          = n_draft;
+            wparams.lookup_ngram     = lookup_ngram;
+            wparams.lookup_phrases   = lookup_phrases_c.data();
+            wparams.n_lookup_phrases = lookup_phrases_c.size();
+            wparams.active_vocab     = vocabulary_c.data();
+            wparams.n_active_vocab   = vocabulary_c.size();
 
             wparams.debug_mode       = params.debug_mode;
 
@@ -489,6 +536,20 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
             Rcpp::Named("stringsAsFactors") = false);
     }
     
+    // average time per call of the sampling / encoder / decoder
+    struct whisper_timings * timings = whisper_get_timings(ctx);
+    Rcpp::List timing = Rcpp::List::create(
+      Rcpp::Named("sample_ms") = timings->sample_ms,
+      Rcpp::Named("encode_ms") = timings->encode_ms,
+      Rcpp::Named("decode_ms") = timings->decode_ms,
+      Rcpp::Named("batchd_ms") = timings->batchd_ms,
+      Rcpp::Named("prompt_ms") = timings->prompt_ms,
+      Rcpp::Named("n_encode") = timings->n_encode,
+      Rcpp::Named("n_encode_cached") = timings->n_encode_cached,
+      Rcpp::Named("n_drafted") = timings->n_drafted,
+      Rcpp::Named("n_accepted") = timings->n_accepted);
+    delete timings;
+    
     //whisper_free(ctx);
     Rcpp::List output = Rcpp::List::create(Rcpp::Named("n_segments") = segment_nr.size(),
                                            Rcpp::Named("data") = Rcpp::DataFrame::create(
@@ -500,6 +561,10 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
                                                Rcpp::Named("speaker") = transcriptions_speaker,
                                                Rcpp::Named("stringsAsFactors") = false),
                                            Rcpp::Named("tokens") = tokens,
+                                           Rcpp::Named("timing") = timing,
+                                           Rcpp::Named("memory") = Rcpp::List::create(
+                                               Rcpp::Named("kv_self_mb") = whisper_kv_self_nbytes(ctx) / 1e6,
+                                               Rcpp::Named("kv_cross_mb") = whisper_kv_cross_nbytes(ctx) / 1e6),
                                            Rcpp::Named("params") = Rcpp::List::create(
                                                Rcpp::Named("audio") = path,
                                                Rcpp::Named("audio_duration_seconds") = audio_duration,
@@ -513,6 +578,9 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
                                                Rcpp::Named("logprob_thold") = params.logprob_thold,
                                                Rcpp::Named("beam_size") = params.beam_size,
                                                Rcpp::Named("best_of") = params.best_of,
+                                               Rcpp::Named("audio_ctx") = params.audio_ctx,
+                                               Rcpp::Named("n_draft") = draft_ctx == nullptr && lookup_ngram <= 0 ? 0 : n_draft,
+                                               Rcpp::Named("lookup_ngram") = lookup_ngram,
                                                Rcpp::Named("split_on_word") = params.split_on_word,
                                                Rcpp::Named("diarize") = params.diarize,
                                                Rcpp::Named("system_info") = Rcpp::List::create(
@@ -527,7 +595,7 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
 
 
 // [[Rcpp::export]]
-void whisper_print_benchmark(SEXP model, int n_threads = 1) {
+Rcpp::List whisper_print_benchmark(SEXP model, int n_threads = 1, bool profile = false) {
   whisper_params params;
   params.n_threads = n_threads;
   // whisper init
@@ -567,6 +635,10 @@ void whisper_print_benchmark(SEXP model, int n_threads = 1) {
   }
   
   whisper_reset_timings(ctx);
+  if (profile) {
+    whisper_reset_profile(ctx);
+    whisper_set_profile(ctx, true);
+  }
   
   // actual run
   if (int ret = whisper_encode(ctx, 0, params.n_threads) != 0) {
@@ -594,6 +666,77 @@ void whisper_print_benchmark(SEXP model, int n_threads = 1) {
     }
   }
   whisper_print_timings(ctx);
+  
+  struct whisper_timings * timings = whisper_get_timings(ctx);
+  Rcpp::List out = Rcpp::List::create(
+    Rcpp::Named("encode_ms") = timings->encode_ms,
+    Rcpp::Named("decode_ms") = timings->decode_ms,
+    Rcpp::Named("batchd_ms") = timings->batchd_ms,
+    Rcpp::Named("prompt_ms") = timings->prompt_ms);
+  delete timings;
+  
+  if (profile) {
+    whisper_set_profile(ctx, false);
+    whisper_print_profile(ctx);
+    const whisper_profile_op * ops = nullptr;
+    const int n_ops = whisper_get_profile(ctx, &ops);
+    Rcpp::CharacterVector graph(n_ops), op(n_ops), kernel(n_ops), type(n_ops);
+    Rcpp::NumericVector m(n_ops), n(n_ops), k(n_ops), t_ms(n_ops);
+    Rcpp::IntegerVector n_calls(n_ops);
+    for (int i = 0; i < n_ops; i++) {
+      graph[i]   = ops[i].graph;
+      op[i]      = ops[i].op;
+      kernel[i]  = ops[i].kernel;
+      type[i]    = ggml_type_name(ops[i].type);
+      m[i]       = ops[i].ne[0];
+      n[i]       = ops[i].ne[1];
+      k[i]       = ops[i].ne[2];
+      n_calls[i] = ops[i].n_calls;
+      t_ms[i]    = 1e-3 * ops[i].t_us;
+    }
+    out["profile"] = Rcpp::DataFrame::create(
+      Rcpp::Named("graph") = graph,
+      Rcpp::Named("op") = op,
+      Rcpp::Named("kernel") = kernel,
+      Rcpp::Named("type") = type,
+      Rcpp::Named("m") = m,
+      Rcpp::Named("n") = n,
+      Rcpp::Named("k") = k,
+      Rcpp::Named("n_calls") = n_calls,
+      Rcpp::Named("t_ms") = t_ms,
+      Rcpp::Named("stringsAsFactors") = false);
+    whisper_reset_profile(ctx);
+  }
+  return out;
+}
+
+// [[Rcpp::export]]
+void whisper_model_convert(std::string path, std::string file) {
+  if (whisper_model_convert_gguf(path.c_str(), file.c_str()) != 0) {
+    Rcpp::stop("Failed to convert the model file " + path + " to the GGUF format");
+  }
+}
+
+// [[Rcpp::export]]
+void whisper_model_quantize_recipe(std::string path, std::string file, std::string type, Rcpp::CharacterVector patterns, Rcpp::CharacterVector types, int n_threads = 0) {
+  std::vector<std::string> recipe_patterns = Rcpp::as<std::vector<std::string>>(patterns);
+  std::vector<const char *> recipe_patterns_c;
+  std::vector<ggml_type> recipe_types;
+  for (int i = 0; i < patterns.size(); i++) {
+    recipe_patterns_c.push_back(recipe_patterns[i].c_str());
+    recipe_types.push_back(ggml_type_from_name(Rcpp::as<std::string>(types[i])));
+  }
+  struct whisper_model_quantize_params params = whisper_model_quantize_default_params();
+  params.type = ggml_type_from_name(type);
+  if (n_threads > 0) {
+    params.n_threads = n_threads;
+  }
+  params.n_patterns = (int) recipe_patterns_c.size();
+  params.patterns = recipe_patterns_c.data();
+  params.types = recipe_types.data();
+  if (whisper_model_quantize(path.c_str(), file.c_str(), &params) != 0) {
+    Rcpp::stop("Failed to quantize the model file " + path + " to " + type);
+  }
 }
 
 